@@ -1,16 +1,64 @@
+/* Dimming table generator
+ *
+ * Generates dimtab.h, translating desired output power to trigger angle.
+ * The 16 bit dimming value range is split into 2^k equal regions, and each
+ * region gets its own number of table entries, so the steep parts of the
+ * curve get more entries than the rest. For every k, the resolution of
+ * each region is chosen to minimize the largest power error while fitting
+ * in the flash budget, or to minimize size while meeting an error target.
+ * Errors are evaluated exactly for every dimming value, using a bit exact
+ * emulation of the interpolation done by the firmware.
+ *
+ * Build: cc -O2 -o dimtab dimtab.c -lm
+ * Usage: dimtab [-b budget_bytes] [-e max_power_error] [-p min_sqrt_power]
+ *               [-h max_hperiod] [-a pot_offset] [-o dimtab.h]
+ * The budget counts table entries and region descriptors. The default is
+ * 66 bytes, the size of the original 33 entry uniform table. With only -e,
+ * the smallest table meeting the error target is generated. A run takes
+ * about 0.3 s, most of it checking scaling for every dimming value and a
+ * spread of hperiod values.
+ *
+ * With -a, a composite table is generated instead, as pottab and
+ * potdelay(), indexed by the averaged pot value. It folds in the offset
+ * added to the pot value and saturation at 0xFFFF, so following the pot
+ * needs no dimming value. It must be generated with the same -p, -b and
+ * -e as dimtab.h. Where the offset pot value saturates, delay has a corner
+ * that costs little power error, so slots must also keep delay error, before
+ * scaling, within the largest the chain through dimtab has. That makes them
+ * finer at the knee. Tools/multsweep -P checks it against the chain.
+ *
+ * dimtab.h also gets the fade curves of main.c, as dimming values at
+ * segment ends of a fade over the whole range. They are derived through
+ * the same curve, so power follows the fade curve instead of the square
+ * root of power.
+ *
+ * Firmware scales the slot's endpoints by the half-period and interpolates
+ * between them, which keeps the result monotonic across slots. Before
+ * writing the header, that conversion is checked against mult(interpolated
+ * delay, hperiod) for hperiod from 1024 to max_hperiod, and must match
+ * within 1. Firmware
+ * builds choose a generated header with DIMTAB_H, and check at compile
+ * time that its max_hperiod covers their clock and mains settings.
+ */
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
 
 #define MAXPOWER 1.570796327
 #define MAXERROR 0.0000001
 
-inline double angle2power(double angle)
+// Largest number of region bits, 32 regions
+#define MAX_KBITS 5
+
+static double angle2power(double angle)
 {
     return 0.5*angle - 0.25*sin(angle*2.0);
 }
 
-inline double angle2powerslope(double angle)
+static double angle2powerslope(double angle)
 {
     double s = sin(angle);
     return s * s;
@@ -29,21 +77,554 @@ double power2angle(double power)
     return estim;
 }
 
+/* Same as mult.asm, with 0xFFFF == 1.0. Its shift and add loop halves r
+ * before each add, and the halvings only drop bits below the final shift,
+ * so it is one multiply. That was checked against the loop for all a and
+ * b, and keeps the exhaustive check() fast. */
+static unsigned short mult(unsigned short a, unsigned short b)
+{
+    return (unsigned long)a * ((b >> 1) + (b & 1)) >> 15;
+}
+
+/*** Curve ***/
+
+static double minpower = 0.124568; // Square root of power at dimming value 0
+static unsigned int potoffset;     // Offset to pot value, for composite table
+static int delaylimit;             // Largest delay error of composite table
+static int entry_cache[65537];
+
+// Dimming value for table index x. For a composite table, x is a pot
+// value, which firmware offsets and saturates.
+static unsigned int dimval(unsigned int x)
+{
+    if (potoffset == 0) return x;
+    x += potoffset;
+    return x > 0xFFFF ? 0xFFFF : x;
+}
+
+// Square root of power at table index x, which may be 0x10000
+static double sqrtpower(unsigned int x)
+{
+    return minpower + (1.0 - minpower) * dimval(x) / 65536.0;
+}
+
+static double entry_angle(unsigned int x)
+{
+    double p = sqrtpower(x);
+    return power2angle(p*p*MAXPOWER);
+}
+
+// Table entry for dimming value x
+static unsigned short entry(unsigned int x)
+{
+    if (entry_cache[x] < 0) {
+        entry_cache[x] = lround(65535.0-entry_angle(x)*65535.0/M_PI);
+    }
+    return entry_cache[x];
+}
+
+// Error in fraction of full power for interpolated table output v
+static double power_error(unsigned int x, unsigned short v)
+{
+    double d = v / 65536.0, p = sqrtpower(x);
+
+    return 1.0 - d + sin(2*M_PI*d)/(2*M_PI) - p*p;
+}
+
+/*** Fade curves ***/
+
+// Segments per fade, as FADE_SEG_BITS in main.c
+#define FADE_SEG_BITS 4
+#define FADE_SEGS (1 << FADE_SEG_BITS)
+#define FADE_CURVES 3
+
+static const char *const fade_name[FADE_CURVES] = {
+    "power linear in t", "CIE lightness 100*t", "power 3*t^2 - 2*t^3"
+};
+
+// Fraction of power range at time t of fade, for curve in main.c order
+static double fade_power(int curve, double t)
+{
+    double l = 100.0 * t;
+
+    switch (curve) {
+    case 0: // FADE_LINEAR
+        return t;
+    case 1: // FADE_PERCEPTUAL, relative luminance from CIE lightness
+        return l > 8.0 ? pow((l + 16.0) / 116.0, 3.0) : l / 903.3;
+    default: // FADE_SCURVE
+        return t * t * (3.0 - 2.0 * t);
+    }
+}
+
+// Fraction of dimming value range giving fraction f of power range
+static double fade_dim(double f)
+{
+    double p0 = minpower * minpower;
+
+    return (sqrt(p0 + (1.0 - p0) * f) - minpower) / (1.0 - minpower);
+}
+
+/*** Search ***/
+
+struct layout {
+    int kbits;                      // log2 of number of regions
+    int res[1 << MAX_KBITS];        // log2 of entries per region
+    double err[1 << MAX_KBITS];     // Largest error in region
+    double maxerr;
+    unsigned int bytes;
+};
+
+// Largest error in region i of 2^kbits regions, with 2^r entries. A
+// composite slot with a delay error over delaylimit gets error 1, larger
+// than any power error, so the search never picks it.
+static double region_error(int kbits, int i, int r)
+{
+    unsigned int rsize = 0x10000 >> kbits, shift = 16 - kbits - r;
+    unsigned int x, start = i * rsize;
+    double maxerr = 0;
+
+    for (x = start; x < start + rsize; x++) {
+        unsigned int bp = x & ~((1U << shift) - 1);
+        unsigned short e0 = entry(bp), e1 = entry(bp + (1U << shift));
+        unsigned short v = e0 - mult(e0 - e1, x << (16 - shift));
+        double err = fabs(power_error(x, v));
+
+        if (err > maxerr) maxerr = err;
+        // The saturation knee is a corner in delay, which costs little
+        // power, so a coarse slot across it is only seen in delay
+        if (delaylimit && abs((int)v - (int)entry(x)) > delaylimit) {
+            return 1.0;
+        }
+    }
+
+    return maxerr;
+}
+
+static unsigned int layout_bytes(int kbits, const int *res)
+{
+    unsigned int i, entries = 1;
+
+    for (i = 0; i < (1U << kbits); i++) entries += 1U << res[i];
+    // Entries, plus shift and first slot for each region
+    return 2 * entries + 2 * (1U << kbits);
+}
+
+// Choose resolutions for 2^kbits regions meeting error limit
+static void fit(int kbits, double errs[][16], double limit, struct layout *l)
+{
+    int i, r, maxres = 15 - kbits;
+
+    l->kbits = kbits;
+    l->maxerr = 0;
+    for (i = 0; i < (1 << kbits); i++) {
+        for (r = 0; r < maxres && errs[i][r] > limit; r++);
+        l->res[i] = r;
+        l->err[i] = errs[i][r];
+        if (l->err[i] > l->maxerr) l->maxerr = l->err[i];
+    }
+    l->bytes = layout_bytes(kbits, l->res);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/* Find best layout with 2^kbits regions. With a budget, minimize the
+ * largest error. Otherwise minimize size while meeting target. Returns
+ * zero if no layout fits. */
+static int search(int kbits, unsigned int budget, double target,
+                  struct layout *l)
+{
+    static double errs[1 << MAX_KBITS][16];
+    double cand[(1 << MAX_KBITS) * 16];
+    int i, r, n = 0, lo, hi, maxres = 15 - kbits;
+
+    for (i = 0; i < (1 << kbits); i++) {
+        for (r = 0; r <= maxres; r++) {
+            errs[i][r] = region_error(kbits, i, r);
+            cand[n++] = errs[i][r];
+        }
+    }
+
+    if (budget == 0) {
+        fit(kbits, errs, target, l);
+        return l->maxerr <= target;
+    }
+
+    // Size only shrinks as allowed error grows, so binary search
+    qsort(cand, n, sizeof(cand[0]), cmp_double);
+    lo = 0;
+    hi = n - 1;
+    fit(kbits, errs, cand[hi], l);
+    if (l->bytes > budget) return 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        fit(kbits, errs, cand[mid], l);
+        if (l->bytes <= budget) hi = mid;
+        else lo = mid + 1;
+    }
+    fit(kbits, errs, cand[lo], l);
+    return 1;
+}
+
+/*** Tables ***/
+
+struct tables {
+    int kbits;
+    unsigned int nregions, entries;
+    unsigned char shift[1 << MAX_KBITS];    // Slot shift within region
+    unsigned short first[1 << MAX_KBITS];   // First slot of region
+    unsigned short *delay;                  // Delay at start of slot
+    unsigned int *x;                        // Dimming value at slot start
+};
+
+static void build(const struct layout *l, struct tables *t)
+{
+    unsigned int i, j, n = 0, rsize = 0x10000 >> l->kbits;
+
+    t->kbits = l->kbits;
+    t->nregions = 1U << l->kbits;
+    t->entries = 1;
+    for (i = 0; i < t->nregions; i++) t->entries += 1U << l->res[i];
+    t->delay = malloc(t->entries * sizeof(*t->delay));
+    t->x = malloc(t->entries * sizeof(*t->x));
+    if (!t->delay || !t->x) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (i = 0; i < t->nregions; i++) {
+        unsigned int step = rsize >> l->res[i];
+
+        t->shift[i] = 16 - l->kbits - l->res[i];
+        t->first[i] = n;
+        for (j = 0; j < (1U << l->res[i]); j++, n++) {
+            t->x[n] = i * rsize + j * step;
+            t->delay[n] = entry(t->x[n]);
+        }
+    }
+    t->x[n] = 0x10000;
+    t->delay[n] = entry(0x10000);
+}
+
+/* Check that conversion with slot endpoints scaled by hperiod matches
+ * mult() of the interpolated delay by hperiod. Returns largest difference,
+ * over all dimming values and hperiod values spread over range. */
+static int check(const struct tables *t, unsigned int hmin, unsigned int hmax)
+{
+    unsigned int dim, h = hmin;
+    int maxdiff = 0;
+
+    while (1) {
+        for (dim = 0; dim < 0x10000; dim++) {
+            unsigned int region = dim >> (16 - t->kbits);
+            unsigned int shift = t->shift[region];
+            unsigned int slot = t->first[region] +
+                ((dim & (0xFFFF >> t->kbits)) >> shift);
+            unsigned short frac = dim << (16 - shift);
+            const unsigned short *d = &t->delay[slot];
+            unsigned short ref = mult(d[0] - mult(d[0] - d[1], frac), h);
+            unsigned short hd0 = mult(d[0], h), hd1 = mult(d[1], h);
+            unsigned short res = hd0 - mult(hd0 - hd1, frac);
+            int diff = abs((int)res - (int)ref);
+
+            if (diff > maxdiff) maxdiff = diff;
+        }
+        if (h == hmax) break;
+        h = (hmax - h > 255) ? h + 255 : hmax;
+    }
+
+    return maxdiff;
+}
+
+/* Largest delay error of the chain through dimming table t, before
+ * scaling, over dimming values the pot reaches with offset added. Entries
+ * must be for the dimming table, with no offset. */
+static int chain_delay_error(const struct tables *t, unsigned int offset)
+{
+    unsigned int dim;
+    int maxerr = 0;
+
+    for (dim = offset; dim < 0x10000; dim++) {
+        unsigned int region = dim >> (16 - t->kbits);
+        unsigned int shift = t->shift[region];
+        const unsigned short *d = &t->delay[t->first[region] +
+            ((dim & (0xFFFF >> t->kbits)) >> shift)];
+        unsigned short v = d[0] - mult(d[0] - d[1], dim << (16 - shift));
+        int err = abs((int)v - (int)entry(dim));
+
+        if (err > maxerr) maxerr = err;
+    }
+
+    return maxerr;
+}
+
+/*** Output ***/
+
+static void report(FILE *f, const struct layout *l)
+{
+    unsigned int i, rsize = 0x10000 >> l->kbits;
+
+    fprintf(f, "/* %u regions, %u bytes, max power error %f\n",
+            1U << l->kbits, l->bytes, l->maxerr);
+    for (i = 0; i < (1U << l->kbits); i++) {
+        fprintf(f, " * 0x%04X-0x%04X: %3u entries, max error %f\n",
+                i * rsize, (i + 1) * rsize - 1, 1U << l->res[i], l->err[i]);
+    }
+    fprintf(f, " */\n");
+}
+
+static void emit(FILE *f, const struct layout *l, const struct tables *t,
+                 unsigned int hmax, int argc, char **argv)
+{
+    // Names for dimming table, or composite table indexed by pot value
+    const char *tab = potoffset ? "pottab" : "dimtab";
+    const char *mac = potoffset ? "POTTAB" : "DIMTAB";
+    const char *fn = potoffset ? "potdelay" : "dimdelay";
+    const char *in = potoffset ? "pot" : "dim";
+    unsigned int i;
+    int c;
+
+    if (potoffset) {
+        fprintf(f, "/* Composite pot table, translating averaged pot value "
+                   "to trigger angle.\n"
+                   " * Generated by: Tools/dimtab");
+        for (i = 1; i < (unsigned int)argc; i++) fprintf(f, " %s", argv[i]);
+        fprintf(f, "\n"
+                   " * It folds in POTTAB_OFFSET added to the pot value and "
+                   "saturation at\n"
+                   " * 0xFFFF, then the dimming curve, with regions and "
+                   "slots like dimtab.h.\n"
+                   " */\n\n");
+    } else {
+        fprintf(f, "/* Dimming table, translating desired output power to "
+                   "trigger angle.\n"
+                   " * Generated by: Tools/dimtab");
+        for (i = 1; i < (unsigned int)argc; i++) fprintf(f, " %s", argv[i]);
+        fprintf(f, "\n"
+                   " * The high order DIMTAB_REGION_BITS of the 16 bit "
+                   "dimming value select a\n"
+                   " * region, which has its own number of table slots. "
+                   "Other bits select a\n"
+                   " * slot and linearly interpolate within it. The last "
+                   "value would correspond\n"
+                   " * to 0x10000, so it is only approached using "
+                   "interpolation from 0xFFFF.\n"
+                   " */\n\n");
+    }
+    report(f, l);
+    fprintf(f, "\n#define %s_REGION_BITS %d\n", mac, t->kbits);
+    fprintf(f, "// Square root of power at dimming value 0\n");
+    fprintf(f, "#define %s_P0 %f\n", mac, minpower);
+    if (potoffset) {
+        fprintf(f, "// Added to pot value, saturating, giving dimming "
+                   "value\n");
+        fprintf(f, "#define %s_OFFSET %u\n", mac, potoffset);
+    }
+    fprintf(f, "// Largest half-period for which %s() was checked\n", fn);
+    fprintf(f, "#define %s_MAX_HPERIOD %u\n\n", mac, hmax);
+
+    fprintf(f, "// Right shift of %s value bits within region, "
+               "giving slot\n", potoffset ? "pot" : "dimming");
+    fprintf(f, "static const unsigned char %s_shift[%u] = {",
+            tab, t->nregions);
+    for (i = 0; i < t->nregions; i++) {
+        fprintf(f, "%s%u", i ? ", " : " ", t->shift[i]);
+    }
+    fprintf(f, " };\n");
+
+    fprintf(f, "// Index of first slot of region\n");
+    fprintf(f, "static const unsigned %s %s_first[%u] = {",
+            t->entries > 256 ? "short" : "char", tab, t->nregions);
+    for (i = 0; i < t->nregions; i++) {
+        fprintf(f, "%s%u", i ? ", " : " ", t->first[i]);
+    }
+    fprintf(f, " };\n\n");
+
+    fprintf(f, "// Trigger delay at start of slot, with 0xFFFF == 1.0\n");
+    fprintf(f, "static const unsigned short %s[%u] = {\n", tab, t->entries);
+    for (i = 0; i < t->entries; i++) {
+        fprintf(f, "    %u, /* %f: %f */\n", t->delay[i], sqrtpower(t->x[i]),
+                entry_angle(t->x[i])/M_PI*180);
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f,
+"/* Slot %s() last scaled, with its base and slope scaled by the h it\n"
+" * was scaled for. Set %s_cslot to %s_NOSLOT when h changes, which\n"
+" * saves keeping h.\n"
+" */\n"
+"#define %s_NOSLOT 0x%X\n"
+"static unsigned %s %s_cslot = %s_NOSLOT;\n"
+"static unsigned short %s_hbase, %s_hslope;\n\n",
+            fn, tab, mac, mac, t->entries > 256 ? 0xFFFF : 0xFF,
+            t->entries > 256 ? "short" : "char", tab, mac, tab, tab);
+
+    fprintf(f,
+"/* Convert %s value to trigger delay in timer cycles, for half-period\n"
+" * h. The slot endpoints are scaled by h before interpolating, which keeps\n"
+" * the result monotonic across slots. While the slot is unchanged, that\n"
+" * is kept, and conversion takes one mult(). Tools/dimtab checked that it\n"
+" * is within 1 of mult(interpolated delay, h) for h up to\n"
+" * %s_MAX_HPERIOD.\n"
+" */\n"
+"static unsigned short %s(unsigned short %s, unsigned short h)\n"
+"{\n"
+"    unsigned char region = %s >> (16 - %s_REGION_BITS);\n"
+"    unsigned char shift = %s_shift[region];\n"
+"    unsigned %s slot = %s_first[region] +\n"
+"        ((%s & (0xFFFF >> %s_REGION_BITS)) >> shift);\n"
+"\n"
+"    if (slot != %s_cslot) {\n"
+"        %s_hbase = mult(%s[slot], h);\n"
+"        %s_hslope = %s_hbase - mult(%s[slot + 1], h);\n"
+"        %s_cslot = slot;\n"
+"    }\n"
+"\n"
+"    // Linearly interpolate between scaled endpoints using remaining bits\n"
+"    return %s_hbase - mult(%s_hslope, %s << (16 - shift));\n"
+"}\n",
+            potoffset ? "pot" : "dimming", mac, fn, in, in, mac, tab,
+            t->entries > 256 ? "short" : "char", tab, in, mac, tab, tab, tab,
+            tab, tab, tab, tab, tab, tab, in);
+    if (potoffset) return;
+
+    fprintf(f, "\n// Fade curves of main.c, as dimming value at segment "
+               "ends of a fade over\n"
+               "// the whole range, so power follows the curve\n");
+    fprintf(f, "#define DIMTAB_FADE_SEG_BITS %d\n", FADE_SEG_BITS);
+    fprintf(f, "static const unsigned short dimtab_fade[%d][%d] = {\n",
+            FADE_CURVES, FADE_SEGS + 1);
+    for (c = 0; c < FADE_CURVES; c++) {
+        unsigned int col = 4;
+
+        fprintf(f, "    // %s\n    {", fade_name[c]);
+        for (i = 0; i <= FADE_SEGS; i++) {
+            char num[8];
+            int len = sprintf(num, "%ld",
+                lround(65535.0 * fade_dim(fade_power(c, (double)i /
+                                                        FADE_SEGS))));
+
+            if (col + len + 2 > 78) {
+                fprintf(f, "\n     ");
+                col = 5;
+            }
+            fprintf(f, " %s%s", num, i < FADE_SEGS ? "," : " ");
+            col += len + 2;
+        }
+        fprintf(f, "}%s\n", c < FADE_CURVES - 1 ? "," : "");
+    }
+    fprintf(f, "};\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-b budget_bytes] [-e max_power_error] "
+                    "[-p min_sqrt_power] [-h max_hperiod] [-a pot_offset] "
+                    "[-o dimtab.h]\n", name);
+    exit(1);
+}
+
+// Best layout over all region counts. Returns zero if none fits.
+static int best_layout(unsigned int budget, double target, struct layout *best)
+{
+    struct layout l;
+    int k, found = 0;
+
+    for (k = 1; k <= MAX_KBITS; k++) {
+        if (!search(k, budget, target, &l)) continue;
+        if (!found ||
+            (budget ? l.maxerr < best->maxerr ||
+                      (l.maxerr == best->maxerr && l.bytes < best->bytes)
+                    : l.bytes < best->bytes ||
+                      (l.bytes == best->bytes && l.maxerr < best->maxerr))) {
+            *best = l;
+            found = 1;
+        }
+    }
+
+    // Error 1 only comes from composite slots over delaylimit
+    return found && best->maxerr < 1.0;
+}
 
 int main(int argc, char **argv)
 {
-    int i, s;
+    unsigned int budget = 0, hmax = 65535;
+    double target = 0;
+    const char *outname = NULL;
+    struct layout best;
+    struct tables t;
+    int opt, diff;
+    FILE *f = stdout;
 
-    if (argc != 2) return -1;
-    s = atoi(argv[1]);
+    while ((opt = getopt(argc, argv, "b:e:p:h:a:o:")) != -1) {
+        switch (opt) {
+        case 'b': budget = atoi(optarg); break;
+        case 'e': target = atof(optarg); break;
+        case 'p': minpower = atof(optarg); break;
+        case 'h': hmax = atoi(optarg); break;
+        case 'a': potoffset = atoi(optarg); break;
+        case 'o': outname = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || minpower < 0 || minpower >= 1 ||
+        hmax < 1024 || hmax > 65535 || potoffset > 0xFFFF) {
+        usage(argv[0]);
+    }
+    if (budget == 0 && target <= 0) budget = 66;
+
+    memset(entry_cache, -1, sizeof(entry_cache));
 
-    for (i = 0; i < s; i++) {
-        /* This contains stupid tweaks to try to fix the lower end so there isn't a range
-         * on the pot where the lamp is basically off, but it doesn't work very well because
-         * pots are non-linear.
-         */
-        double angle, power = ((double)i / (s - 1 + 0.55338)) + 0.545/(s-1);
-        angle = power2angle(power*power*MAXPOWER);
-        printf("    %.0f, /* %f: %f */\n", 65535.0-angle*65535.0/M_PI, power, angle/M_PI*180);
+    if (potoffset) {
+        unsigned int offset = potoffset;
+
+        // Build the dimming table the same options give, and hold the
+        // composite table to the delay error of the chain through it
+        potoffset = 0;
+        if (!best_layout(budget, target, &best)) {
+            fprintf(stderr, "No dimming table fits\n");
+            return 1;
+        }
+        build(&best, &t);
+        delaylimit = chain_delay_error(&t, offset);
+        free(t.delay);
+        free(t.x);
+        potoffset = offset;
+        memset(entry_cache, -1, sizeof(entry_cache));
     }
+
+    if (!best_layout(budget, target, &best)) {
+        fprintf(stderr, "No table fits\n");
+        return 1;
+    }
+
+    report(stderr, &best);
+    if (budget && target > 0 && best.maxerr > target) {
+        fprintf(stderr, "Error target %f not met within %u bytes\n",
+                target, budget);
+    }
+
+    build(&best, &t);
+    diff = check(&t, 1024, hmax);
+    if (diff > 1) {
+        fprintf(stderr, "Scaled conversion differs by %d for hperiod up to "
+                        "%u, try a lower -h\n", diff, hmax);
+        return 1;
+    }
+
+    if (outname != NULL) {
+        f = fopen(outname, "w");
+        if (f == NULL) {
+            perror(outname);
+            return 1;
+        }
+    }
+    emit(f, &best, &t, hmax, argc, argv);
+    if (f != stdout) fclose(f);
+
+    return 0;
 }
@@ -0,0 +1,365 @@
+/* Cycle counts and exhaustive check of the mult.asm variants
+ *
+ * Each MULT_IMPL variant in mult.asm is emulated instruction by instruction,
+ * counting MSP430 CPU cycles as given in the [n] comments there, plus 5 for
+ * the call #mult. For all 2^32 operand pairs, results are compared with the
+ * original loop, and the best, worst and average cycle counts are reported.
+ *
+ * Build: cc -O3 -o multcycles multcycles.c -lpthread
+ * Usage: multcycles [-t threads]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NIMPL 4
+
+// Cycles for call #mult
+#define CALL_CYCLES 5
+
+static const char *const impl_name[NIMPL] = {
+    "loop", "byte early-out", "unrolled", "hardware multiplier"
+};
+
+// Code size in bytes, from the instruction listing in mult.asm
+static const unsigned int impl_size[NIMPL] = { 32, 78, 136, 36 };
+
+// Reference, from Tools/mult.c
+static unsigned short mult_ref(unsigned short r12, unsigned short r13)
+{
+    unsigned short c1, c2, r14 = r12;
+
+    r12 = 0;
+
+    c1 = r13 & 1;
+
+    r13 >>= 1;
+    r13 += c1;
+
+    c1 = 1;
+multlp:
+    c2 = r14 & 1;
+    r14 = (r14 >> 1) | (c1 ? 0x8000 : 0);
+
+    if (!c2) goto multzb;
+    if (r14 == 0) goto multend;;
+
+    r12 >>= 1;
+    r12 += r13;
+    c1 = 0;
+    goto multlp;
+
+multzb:
+    r12 >>= 1;
+    c1 = 0;
+    goto multlp;
+
+multend:
+    return r12;
+}
+
+// Rotate right through carry
+#define RRC(r, c) do { \
+    unsigned int rrc_out = (r) & 1; \
+    (r) = ((r) >> 1) | ((c) ? 0x8000 : 0); \
+    (c) = rrc_out; \
+} while (0)
+
+// MULT_IMPL 0
+static unsigned short mult_loop(unsigned short r12, unsigned short r13,
+                                unsigned int *cyc)
+{
+    unsigned short r14;
+    unsigned int c, n = CALL_CYCLES;
+
+    r14 = r12; n += 1;
+    r12 = 0; c = 0; n += 1;
+    RRC(r13, c); n += 1;
+    r13 += c; c = 0; n += 1;
+    c = 1; n += 1;
+multlp:
+    RRC(r14, c); n += 1;
+    n += 2; if (!c) goto multzb;
+    n += 2; if (r14 == 0) goto multend;
+    c = 0; n += 1;
+    RRC(r12, c); n += 1;
+    c = r12 + r13 > 0xFFFF; r12 += r13; n += 1;
+    n += 2; goto multlp;
+multzb:
+    RRC(r12, c); n += 1;
+    c = 0; n += 1;
+    n += 2; goto multlp;
+multend:
+    n += 3;
+    *cyc = n;
+    return r12;
+}
+
+// MULT_IMPL 1
+static unsigned short mult_bytes(unsigned short r12, unsigned short r13,
+                                 unsigned int *cyc)
+{
+    unsigned short r14, r15;
+    unsigned int c, n = CALL_CYCLES;
+
+    r14 = r12; n += 1;
+    r12 = 0; c = 0; n += 1;
+    RRC(r13, c); n += 1;
+    r13 += c; c = 0; n += 1;
+    n += 2; if (r13 == 0) goto multend;
+
+    c = 1; n += 1;
+    n += 2; if ((r14 & 0xFF) == 0) goto multhi;
+    r15 = r14 & 0xFF; n += 1;
+    r15 += 0x100; c = 0; n += 2;
+multlo:
+    RRC(r15, c); n += 1;
+    n += 2; if (!c) goto multlz;
+    n += 2; if (r15 == 0) goto multhi;
+    c = 0; n += 1;
+    RRC(r12, c); n += 1;
+    c = r12 + r13 > 0xFFFF; r12 += r13; n += 1;
+    n += 2; goto multlo;
+multlz:
+    RRC(r12, c); n += 1;
+    c = 0; n += 1;
+    n += 2; goto multlo;
+
+multhi:
+    r14 = (r14 >> 8) | (r14 << 8); n += 1;
+    c = 1; n += 1;
+    n += 2; if ((r14 & 0xFF) == 0) goto multsh;
+    r14 &= 0xFF; n += 1;
+    r14 += 0x100; c = 0; n += 2;
+multhl:
+    RRC(r14, c); n += 1;
+    n += 2; if (!c) goto multhz;
+    n += 2; if (r14 == 0) goto multend;
+    c = 0; n += 1;
+    RRC(r12, c); n += 1;
+    c = r12 + r13 > 0xFFFF; r12 += r13; n += 1;
+    n += 2; goto multhl;
+multhz:
+    RRC(r12, c); n += 1;
+    c = 0; n += 1;
+    n += 2; goto multhl;
+
+multsh:
+    r12 = (r12 >> 8) | (r12 << 8); n += 1;
+    r12 &= 0xFF; n += 1;
+multend:
+    n += 3;
+    *cyc = n;
+    return r12;
+}
+
+// MULT_IMPL 2
+static unsigned short mult_unrolled(unsigned short r12, unsigned short r13,
+                                    unsigned int *cyc)
+{
+    unsigned short r14;
+    unsigned int c, i, n = CALL_CYCLES;
+
+    r14 = r12; n += 1;
+    r12 = 0; c = 0; n += 1;
+    RRC(r13, c); n += 1;
+    r13 += c; c = 0; n += 1;
+
+    RRC(r14, c); n += 1;
+    n += 2;
+    if (c) {
+        c = r12 + r13 > 0xFFFF; r12 += r13; n += 1;
+    }
+    for (i = 0; i < 15; i++) {
+        RRC(r12, c); n += 1;
+        RRC(r14, c); n += 1;
+        n += 2;
+        if (c) {
+            c = r12 + r13 > 0xFFFF; r12 += r13; n += 1;
+        }
+    }
+    n += 3;
+    *cyc = n;
+    return r12;
+}
+
+// MULT_IMPL 3
+static unsigned short mult_hw(unsigned short r12, unsigned short r13,
+                              unsigned int *cyc)
+{
+    unsigned short r14;
+    unsigned long p;
+    unsigned int c, n = CALL_CYCLES;
+
+    c = 0; n += 1;
+    RRC(r13, c); n += 1;
+    r13 += c; n += 1;
+    n += 3;                       // push.w SR
+    n += 1;                       // dint
+    n += 1;                       // nop
+    p = r12; n += 4;              // mov.w r12,&MPY
+    p *= r13; n += 4;             // mov.w r13,&OP2
+    r14 = p; n += 3;              // mov.w &RESLO,r14
+    r12 = p >> 16; n += 3;        // mov.w &RESHI,r12
+    n += 2;                       // pop.w SR
+    c = r14 >> 15; r14 <<= 1; n += 1;
+    r12 = (r12 << 1) | c; n += 1;
+    n += 3;
+    *cyc = n;
+    return r12;
+}
+
+static unsigned short (*const impl_fn[NIMPL])(unsigned short, unsigned short,
+                                              unsigned int *) = {
+    mult_loop, mult_bytes, mult_unrolled, mult_hw
+};
+
+struct stats {
+    unsigned int min, max;
+    unsigned short min_a, min_b, max_a, max_b;
+    unsigned long long sum;
+    unsigned long long mismatches;
+    unsigned short bad_a, bad_b;
+};
+
+struct result {
+    unsigned int first, last;   // Range of a
+    struct stats st[NIMPL];
+};
+
+static void *sweep(void *arg)
+{
+    struct result *res = arg;
+    unsigned int a, b, i, cyc;
+    unsigned short ref, r;
+
+    for (i = 0; i < NIMPL; i++) {
+        res->st[i].min = ~0U;
+    }
+
+    for (a = res->first; a <= res->last; a++) {
+        for (b = 0; b < 65536; b++) {
+            ref = mult_ref(a, b);
+            for (i = 0; i < NIMPL; i++) {
+                struct stats *s = &res->st[i];
+
+                r = impl_fn[i](a, b, &cyc);
+                if (r != ref) {
+                    if (s->mismatches++ == 0) {
+                        s->bad_a = a;
+                        s->bad_b = b;
+                    }
+                }
+                s->sum += cyc;
+                if (cyc < s->min) {
+                    s->min = cyc;
+                    s->min_a = a;
+                    s->min_b = b;
+                }
+                if (cyc > s->max) {
+                    s->max = cyc;
+                    s->max_a = a;
+                    s->max_b = b;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-t threads]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct result *res;
+    struct stats tot[NIMPL];
+    pthread_t *threads;
+    unsigned int i, j;
+    int opt, fail = 0;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || nthreads < 1 || nthreads > 65536) usage(argv[0]);
+
+    res = calloc(nthreads, sizeof(*res));
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!res || !threads) {
+        perror("malloc");
+        return 1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        res[i].first = 65536ULL * i / nthreads;
+        res[i].last = 65536ULL * (i + 1) / nthreads - 1;
+        if (pthread_create(&threads[i], NULL, sweep, &res[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    memset(tot, 0, sizeof(tot));
+    for (j = 0; j < NIMPL; j++) {
+        tot[j].min = ~0U;
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        for (j = 0; j < NIMPL; j++) {
+            struct stats *s = &res[i].st[j], *t = &tot[j];
+
+            if (s->mismatches && !t->mismatches) {
+                t->bad_a = s->bad_a;
+                t->bad_b = s->bad_b;
+            }
+            t->mismatches += s->mismatches;
+            t->sum += s->sum;
+            if (s->min < t->min) {
+                t->min = s->min;
+                t->min_a = s->min_a;
+                t->min_b = s->min_b;
+            }
+            if (s->max > t->max) {
+                t->max = s->max;
+                t->max_a = s->max_a;
+                t->max_b = s->max_b;
+            }
+        }
+    }
+
+    printf("Checked all 2^32 operand pairs with %ld threads\n", nthreads);
+    printf("MULT_IMPL  bytes  best           worst          average  "
+           "implementation\n");
+    for (j = 0; j < NIMPL; j++) {
+        struct stats *t = &tot[j];
+
+        printf("%-9u  %5u  %3u (%04X,%04X) %3u (%04X,%04X) %7.2f  %s\n",
+               j, impl_size[j], t->min, t->min_a, t->min_b,
+               t->max, t->max_a, t->max_b, t->sum / 4294967296.0,
+               impl_name[j]);
+    }
+    for (j = 0; j < NIMPL; j++) {
+        if (tot[j].mismatches) {
+            printf("MULT_IMPL %u: %llu results differ, first at a=%04X "
+                   "b=%04X\n", j, tot[j].mismatches,
+                   tot[j].bad_a, tot[j].bad_b);
+            fail = 1;
+        }
+    }
+
+    return fail;
+}
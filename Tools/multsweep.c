@@ -0,0 +1,587 @@
+/* Exhaustive accuracy check of dimtab interpolation and mult() scaling
+ *
+ * For every 16 bit dimming value and every half-period in a range, this
+ * computes triacdelay exactly like dimdelay() in dimtab.h, with a bit exact
+ * emulation of mult.asm. The delivered power is compared with the power
+ * the table was generated for, and triacdelay with the angle found via
+ * Newton's method as in Tools/dimtab.c. Triacdelay must never increase
+ * as the dimming value increases, and must be within 1 of mult() of the
+ * interpolated delay by hperiod.
+ *
+ * Work is split across threads by dimming value. For a given dimming value,
+ * all half-periods are computed at once in SIMD lanes.
+ *
+ * With -P, the composite table from Tools/dimtab -a is swept instead, by
+ * averaged pot value, like potdelay(). Power is compared with the curve at
+ * the offset and saturated dimming value, and triacdelay with the chain
+ * through dimtab. The composite table must not have a larger power error
+ * before scaling than that chain, nor a larger delay error before scaling,
+ * give or take the 1 LSB of rounding table entries. Build with POTTAB_H set
+ * to its header.
+ *
+ * Build: cc -O3 -march=native -fopenmp-simd -o multsweep multsweep.c \
+ *           -lm -lpthread
+ *        Add -DPOTTAB_H='"../pottab.h"' for -P.
+ * Usage: multsweep [-t threads] [-h min_hperiod:max_hperiod] [-P]
+ * The default range is 1024 to DIMTAB_MAX_HPERIOD.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define MAXERROR 0.0000001
+
+// Half-periods are processed in blocks this size, staying in L1 cache
+#define BLOCK 512
+
+unsigned short mult(unsigned short r12, unsigned short r13)
+{
+    unsigned short c1, c2, r14 = r12;
+
+    r12 = 0;
+
+    c1 = r13 & 1;
+
+    r13 >>= 1;
+    r13 += c1;
+
+    c1 = 1;
+multlp:
+    c2 = r14 & 1;
+    r14 = (r14 >> 1) | (c1 ? 0x8000 : 0);
+
+    if (!c2) goto multzb;
+    if (r14 == 0) goto multend;;
+
+    r12 >>= 1;
+    r12 += r13;
+    c1 = 0;
+    goto multlp;
+
+multzb:
+    r12 >>= 1;
+    c1 = 0;
+    goto multlp;
+
+multend:
+    return r12;
+}
+
+#include "../dimtab.h"
+#ifdef POTTAB_H
+#include POTTAB_H
+#endif
+
+static double angle2power(double angle)
+{
+    return 0.5*angle - 0.25*sin(angle*2.0);
+}
+
+static double angle2powerslope(double angle)
+{
+    double s = sin(angle);
+    return s * s;
+}
+
+static double power2angle(double power)
+{
+    double err, estim = M_PI/2;
+
+    while (1) {
+        err = angle2power(estim) - power;
+        if (err <= MAXERROR && err >= -MAXERROR) break;
+        estim -= err/angle2powerslope(estim);
+    }
+    return estim;
+}
+
+/*** Sweep ***/
+
+static unsigned int hmin = 1024, hmax = DIMTAB_MAX_HPERIOD, nh;
+static unsigned short *hhalf;   // Rounded half of hperiod, as used by mult()
+static double *hrecip;          // 1 / hperiod
+static double *hval;            // hperiod
+static int potmode;             // Sweeping pot values through pottab
+
+struct result {
+    unsigned int first, last;   // Dimming values swept by thread
+    double sumsq;               // Sum of squared power error
+    double pmax;                // Largest power error
+    unsigned int pmax_dim, pmax_h;
+    double dmax;                // Largest delay error, in ticks
+    unsigned int dmax_dim, dmax_h;
+    double tabmax;              // Largest power error before scaling
+    unsigned int tabmax_dim;
+    double tabdmax;             // Largest delay error before scaling, as
+    unsigned int tabdmax_dim;   // fraction of half-period
+    unsigned long long violations;
+    unsigned int viol_dim, viol_h;
+    unsigned int sdiff;         // Largest difference from two mult() path
+    unsigned int sdiff_dim, sdiff_h;
+    double chainmax;            // With -P, largest power error of chain
+    unsigned int chainmax_dim;  // through dimtab before scaling,
+    double chaindmax;           // its largest delay error,
+    unsigned int chaindmax_dim;
+    unsigned int cdiff;         // and difference from it after scaling
+    unsigned int cdiff_dim, cdiff_h;
+};
+
+/* mult(a, hperiod) for a block of half-periods. The loop in mult.asm
+ * always runs for 16 bits of a, so all lanes take the same path. */
+static void mult_block(unsigned short a, const unsigned short *hh,
+                       unsigned short *r, unsigned int n)
+{
+    unsigned int bit, j;
+
+    for (j = 0; j < n; j++) r[j] = 0;
+    for (bit = 0; bit < 16; bit++) {
+        if (a & (1 << bit)) {
+            for (j = 0; j < n; j++) r[j] = (r[j] >> 1) + hh[j];
+        } else {
+            for (j = 0; j < n; j++) r[j] >>= 1;
+        }
+    }
+}
+
+// mult(a[j], b) for a block, selecting the addition per lane
+static void mult_lanes(const unsigned short *a, unsigned short b,
+                       unsigned short *r, unsigned int n)
+{
+    unsigned int bit, j;
+
+    b = (b >> 1) + (b & 1);
+    for (j = 0; j < n; j++) r[j] = 0;
+    for (bit = 0; bit < 16; bit++) {
+        for (j = 0; j < n; j++) {
+            r[j] = (r[j] >> 1) + (-((a[j] >> bit) & 1) & b);
+        }
+    }
+}
+
+// Slot lookup from dimdelay()
+struct slot {
+    unsigned short d0, d1, frac;
+};
+
+static void dim_slot(unsigned short dim, struct slot *s)
+{
+    unsigned char region = dim >> (16 - DIMTAB_REGION_BITS);
+    unsigned char shift = dimtab_shift[region];
+    unsigned short slot = dimtab_first[region] +
+                          ((dim & (0xFFFF >> DIMTAB_REGION_BITS)) >> shift);
+
+    s->d0 = dimtab[slot];
+    s->d1 = dimtab[slot + 1];
+    s->frac = dim << (16 - shift);
+}
+
+#ifdef POTTAB_H
+// Slot lookup from potdelay()
+static void pot_slot(unsigned short pot, struct slot *s)
+{
+    unsigned char region = pot >> (16 - POTTAB_REGION_BITS);
+    unsigned char shift = pottab_shift[region];
+    unsigned short slot = pottab_first[region] +
+                          ((pot & (0xFFFF >> POTTAB_REGION_BITS)) >> shift);
+
+    s->d0 = pottab[slot];
+    s->d1 = pottab[slot + 1];
+    s->frac = pot << (16 - shift);
+}
+
+// Dimming value firmware gets from pot value, as folded into pottab
+static unsigned short pot_dim(unsigned short pot)
+{
+    unsigned int dim = pot + POTTAB_OFFSET;
+
+    return dim > 0xFFFF ? 0xFFFF : dim;
+}
+#endif
+
+// Slot of swept table
+static void find_slot(unsigned short x, struct slot *s)
+{
+#ifdef POTTAB_H
+    if (potmode) {
+        pot_slot(x, s);
+        return;
+    }
+#endif
+    dim_slot(x, s);
+}
+
+// Delay from dimdelay() for a block of half-periods
+static void dimdelay_block(const struct slot *s, const unsigned short *hh,
+                           unsigned short *r, unsigned int n)
+{
+    unsigned short hbase[BLOCK], hnext[BLOCK], term[BLOCK];
+    unsigned int j;
+
+    mult_block(s->d0, hh, hbase, n);
+    mult_block(s->d1, hh, hnext, n);
+    for (j = 0; j < n; j++) hnext[j] = hbase[j] - hnext[j];
+    mult_lanes(hnext, s->frac, term, n);
+    for (j = 0; j < n; j++) r[j] = hbase[j] - term[j];
+}
+
+// Interpolated delay before scaling, with 0xFFFF == 1.0
+static unsigned short interpolate(const struct slot *s)
+{
+    return s->d0 - mult(s->d0 - s->d1, s->frac);
+}
+
+static void *sweep(void *arg)
+{
+    struct result *res = arg;
+    unsigned short *prev = malloc(nh * sizeof(*prev));
+    unsigned short *cur = malloc(nh * sizeof(*cur));
+    unsigned short ref[BLOCK];
+    unsigned int dim, base, j;
+    struct slot sl;
+
+    if (prev == NULL || cur == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Previous row for checking monotonicity at start of range
+    if (res->first > 0) {
+        find_slot(res->first - 1, &sl);
+        for (base = 0; base < nh; base += BLOCK) {
+            unsigned int n = nh - base < BLOCK ? nh - base : BLOCK;
+            dimdelay_block(&sl, hhalf + base, prev + base, n);
+        }
+    }
+
+    for (dim = res->first; dim <= res->last; dim++) {
+        unsigned short a = (find_slot(dim, &sl), interpolate(&sl));
+#ifdef POTTAB_H
+        unsigned int cdim = potmode ? pot_dim(dim) : dim;
+        struct slot cs;
+#else
+        unsigned int cdim = dim;
+#endif
+        double p = DIMTAB_P0 + (1.0 - DIMTAB_P0) * cdim / 65536.0;
+        double pideal = p * p;
+        // Ideal delay as fraction of half-period
+        double dideal = 1.0 - power2angle(pideal * M_PI / 2) / M_PI;
+        /* Delivered power P(d) = 1 - d + sin(2 pi d) / (2 pi), with d the
+         * delay as fraction of the half-period. Use a Taylor series around
+         * the unscaled interpolated value. Truncation in mult() moves d by
+         * under 16 / hperiod, so the third order series is exact to 1e-7
+         * for hperiod >= 256. */
+        double d0 = a / 65536.0, w = 2 * M_PI * d0;
+        double c0 = 1.0 - d0 + sin(w) / (2 * M_PI) - pideal;
+        double c1 = cos(w) - 1.0;
+        double c2 = -M_PI * sin(w);
+        double c3 = -2.0 / 3.0 * M_PI * M_PI * cos(w);
+        double sumsq = 0, pmax = 0, dmax = 0;
+        unsigned long long viol = 0;
+
+        if (fabs(c0) > res->tabmax) {
+            res->tabmax = fabs(c0);
+            res->tabmax_dim = dim;
+        }
+        if (fabs(d0 - dideal) > res->tabdmax) {
+            res->tabdmax = fabs(d0 - dideal);
+            res->tabdmax_dim = dim;
+        }
+#ifdef POTTAB_H
+        if (potmode) {
+            // Chain through dimtab, before scaling
+            double cd, cerr;
+
+            dim_slot(cdim, &cs);
+            cd = interpolate(&cs) / 65536.0;
+            cerr = fabs(1.0 - cd + sin(2 * M_PI * cd) / (2 * M_PI) - pideal);
+            if (cerr > res->chainmax) {
+                res->chainmax = cerr;
+                res->chainmax_dim = dim;
+            }
+            if (fabs(cd - dideal) > res->chaindmax) {
+                res->chaindmax = fabs(cd - dideal);
+                res->chaindmax_dim = dim;
+            }
+        }
+#endif
+
+        for (base = 0; base < nh; base += BLOCK) {
+            unsigned int n = nh - base < BLOCK ? nh - base : BLOCK;
+            unsigned short *r = cur + base, *pr = prev + base;
+            const double *rh = hrecip + base, *hv = hval + base;
+            double bpmax = 0, bdmax = 0;
+            unsigned int bviol = 0, bsdiff = 0;
+
+            dimdelay_block(&sl, hhalf + base, r, n);
+
+            // Compare with scaling interpolated delay
+            mult_block(a, hhalf + base, ref, n);
+#pragma omp simd reduction(max:bsdiff)
+            for (j = 0; j < n; j++) {
+                unsigned int d = r[j] > ref[j] ? r[j] - ref[j] : ref[j] - r[j];
+                bsdiff = d > bsdiff ? d : bsdiff;
+            }
+            if (bsdiff > res->sdiff) {
+                for (j = 0; j < n; j++) {
+                    if (abs((int)r[j] - (int)ref[j]) == (int)bsdiff) break;
+                }
+                res->sdiff = bsdiff;
+                res->sdiff_dim = dim;
+                res->sdiff_h = hmin + base + j;
+            }
+
+#ifdef POTTAB_H
+            // Compare with chain through dimtab
+            if (potmode) {
+                unsigned int bcdiff = 0;
+
+                dimdelay_block(&cs, hhalf + base, ref, n);
+                for (j = 0; j < n; j++) {
+                    unsigned int d = abs((int)r[j] - (int)ref[j]);
+                    bcdiff = d > bcdiff ? d : bcdiff;
+                }
+                if (bcdiff > res->cdiff) {
+                    for (j = 0; j < n; j++) {
+                        if (abs((int)r[j] - (int)ref[j]) == (int)bcdiff) break;
+                    }
+                    res->cdiff = bcdiff;
+                    res->cdiff_dim = dim;
+                    res->cdiff_h = hmin + base + j;
+                }
+            }
+#endif
+
+#pragma omp simd reduction(+:sumsq) reduction(max:bpmax, bdmax)
+            for (j = 0; j < n; j++) {
+                double e = r[j] * rh[j] - d0;
+                double perr = c0 + e * (c1 + e * (c2 + e * c3));
+                double derr = fabs(r[j] - dideal * hv[j]);
+
+                perr = fabs(perr);
+                sumsq += perr * perr;
+                bpmax = perr > bpmax ? perr : bpmax;
+                bdmax = derr > bdmax ? derr : bdmax;
+            }
+
+            if (dim > 0) {
+#pragma omp simd reduction(+:bviol)
+                for (j = 0; j < n; j++) bviol += r[j] > pr[j];
+            }
+
+            // Locate worst cases outside the vectorized loops
+            if (bpmax > pmax) {
+                pmax = bpmax;
+                if (pmax > res->pmax) {
+                    for (j = 0; j < n; j++) {
+                        double e = r[j] * rh[j] - d0;
+                        double perr = c0 + e * (c1 + e * (c2 + e * c3));
+                        if (fabs(perr) == pmax) break;
+                    }
+                    res->pmax = pmax;
+                    res->pmax_dim = dim;
+                    res->pmax_h = hmin + base + (j < n ? j : 0);
+                }
+            }
+            if (bdmax > dmax) {
+                dmax = bdmax;
+                if (dmax > res->dmax) {
+                    for (j = 0; j < n; j++) {
+                        if (fabs(r[j] - dideal * hv[j]) == dmax) break;
+                    }
+                    res->dmax = dmax;
+                    res->dmax_dim = dim;
+                    res->dmax_h = hmin + base + (j < n ? j : 0);
+                }
+            }
+            if (bviol) {
+                if (res->violations == 0 && viol == 0) {
+                    for (j = 0; j < n && r[j] <= pr[j]; j++);
+                    res->viol_dim = dim;
+                    res->viol_h = hmin + base + j;
+                }
+                viol += bviol;
+            }
+        }
+
+        res->sumsq += sumsq;
+        res->violations += viol;
+
+        // Current row becomes previous row
+        {
+            unsigned short *t = prev;
+            prev = cur;
+            cur = t;
+        }
+    }
+
+    free(prev);
+    free(cur);
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-h min_hperiod:max_hperiod] "
+                    "[-P]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *name;
+    struct result *res, tot;
+    pthread_t *threads;
+    unsigned int i, h;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:h:P")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atol(optarg);
+            break;
+        case 'h':
+            if (sscanf(optarg, "%u:%u", &hmin, &hmax) != 2) usage(argv[0]);
+            break;
+        case 'P':
+#ifdef POTTAB_H
+            potmode = 1;
+            break;
+#else
+            fprintf(stderr, "Built without POTTAB_H\n");
+            return 1;
+#endif
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || nthreads < 1 || hmin < 256 || hmax > 65535 ||
+        hmin > hmax) {
+        usage(argv[0]);
+    }
+
+#ifdef POTTAB_H
+    if (potmode && hmax > POTTAB_MAX_HPERIOD) usage(argv[0]);
+#endif
+    name = potmode ? "pot" : "dimpower";
+
+    nh = hmax - hmin + 1;
+    hhalf = malloc(nh * sizeof(*hhalf));
+    hrecip = malloc(nh * sizeof(*hrecip));
+    hval = malloc(nh * sizeof(*hval));
+    res = calloc(nthreads, sizeof(*res));
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!hhalf || !hrecip || !hval || !res || !threads) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < nh; i++) {
+        h = hmin + i;
+        // Same rounding as start of mult.asm
+        hhalf[i] = (h >> 1) + (h & 1);
+        hval[i] = h;
+        hrecip[i] = 1.0 / h;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        res[i].first = 65536ULL * i / nthreads;
+        res[i].last = 65536ULL * (i + 1) / nthreads - 1;
+        if (pthread_create(&threads[i], NULL, sweep, &res[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    memset(&tot, 0, sizeof(tot));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        tot.sumsq += res[i].sumsq;
+        if (res[i].pmax > tot.pmax) {
+            tot.pmax = res[i].pmax;
+            tot.pmax_dim = res[i].pmax_dim;
+            tot.pmax_h = res[i].pmax_h;
+        }
+        if (res[i].dmax > tot.dmax) {
+            tot.dmax = res[i].dmax;
+            tot.dmax_dim = res[i].dmax_dim;
+            tot.dmax_h = res[i].dmax_h;
+        }
+        if (res[i].tabmax > tot.tabmax) {
+            tot.tabmax = res[i].tabmax;
+            tot.tabmax_dim = res[i].tabmax_dim;
+        }
+        if (res[i].violations && !tot.violations) {
+            tot.viol_dim = res[i].viol_dim;
+            tot.viol_h = res[i].viol_h;
+        }
+        tot.violations += res[i].violations;
+        if (res[i].sdiff > tot.sdiff) {
+            tot.sdiff = res[i].sdiff;
+            tot.sdiff_dim = res[i].sdiff_dim;
+            tot.sdiff_h = res[i].sdiff_h;
+        }
+        if (res[i].tabdmax > tot.tabdmax) {
+            tot.tabdmax = res[i].tabdmax;
+            tot.tabdmax_dim = res[i].tabdmax_dim;
+        }
+        if (res[i].chainmax > tot.chainmax) {
+            tot.chainmax = res[i].chainmax;
+            tot.chainmax_dim = res[i].chainmax_dim;
+        }
+        if (res[i].chaindmax > tot.chaindmax) {
+            tot.chaindmax = res[i].chaindmax;
+            tot.chaindmax_dim = res[i].chaindmax_dim;
+        }
+        if (res[i].cdiff > tot.cdiff) {
+            tot.cdiff = res[i].cdiff;
+            tot.cdiff_dim = res[i].cdiff_dim;
+            tot.cdiff_h = res[i].cdiff_h;
+        }
+    }
+
+    printf("Swept 65536 %s values x hperiod %u to %u "
+           "(%llu combinations) with %ld threads\n", potmode ? "pot" :
+           "dimming", hmin, hmax, 65536ULL * nh, nthreads);
+    printf("Power error: max %.7f at %s %u hperiod %u, RMS %.7f\n",
+           tot.pmax, name, tot.pmax_dim, tot.pmax_h,
+           sqrt(tot.sumsq / (65536.0 * nh)));
+    printf("Power error before scaling: max %.7f at %s %u\n",
+           tot.tabmax, name, tot.tabmax_dim);
+    printf("Delay error before scaling: max %.7f of half-period at %s %u\n",
+           tot.tabdmax, name, tot.tabdmax_dim);
+    if (potmode) {
+        printf("Chain through dimtab before scaling: max %.7f at pot %u\n",
+               tot.chainmax, tot.chainmax_dim);
+        printf("Chain delay error before scaling: max %.7f at pot %u\n",
+               tot.chaindmax, tot.chaindmax_dim);
+        printf("Largest difference from chain through dimtab: %u ticks",
+               tot.cdiff);
+        if (tot.cdiff) {
+            printf(" at pot %u hperiod %u", tot.cdiff_dim, tot.cdiff_h);
+        }
+        printf("\n");
+    }
+    printf("Delay error: max %.2f ticks at %s %u hperiod %u\n",
+           tot.dmax, name, tot.dmax_dim, tot.dmax_h);
+    if (tot.violations) {
+        printf("Monotonicity violations: %llu, first at %s %u "
+               "hperiod %u\n", tot.violations, name, tot.viol_dim,
+               tot.viol_h);
+    } else {
+        printf("Monotonicity violations: 0\n");
+    }
+    printf("Largest difference from mult() of interpolated delay: %u",
+           tot.sdiff);
+    if (tot.sdiff) {
+        printf(" at %s %u hperiod %u", name, tot.sdiff_dim, tot.sdiff_h);
+    }
+    printf("\n");
+
+    return tot.violations != 0 || tot.sdiff > 1 ||
+           (potmode && (tot.tabmax > tot.chainmax ||
+                        tot.tabdmax > tot.chaindmax + 1.0 / 65536));
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# RAM check of main.c for the MSP430G2231
+#
+# main.c is compiled for the host against the stub io430.h of Tools/sim,
+# with 32 bit long as on MSP430, and the sizes of its variables are summed.
+# Records in information memory are flash, so they are left out. Variables
+# of 2 or 4 bytes are word aligned on MSP430, and bytes are packed, so only
+# the total is rounded up to a word. STACK_BYTES from main.c, a worst case
+# with nested interrupts for the build, is added, and the sum is compared
+# with RAM.
+#
+# Code size needs the MSP430 compiler, so flash is checked by the IAR
+# linker, which fails when code doesn't fit and lists sizes in its map file.
+# Constant tables are counted here too, because they are the same size on
+# MSP430.
+#
+# Needs a C compiler which can build 32 bit code, such as gcc -m32.
+#
+# Usage: Tools/ramcheck.sh [-r ram_bytes] [-v] [cflags]...
+# For example: Tools/ramcheck.sh -DSERIAL_BAUD=9600
+# Option -v lists variables by size. Exits with status 1 if RAM overflows.
+
+ram=128
+verbose=
+while [ $# -gt 0 ]; do
+    case "$1" in
+    -r) ram="$2"; shift 2 ;;
+    -v) verbose=1; shift ;;
+    *) break ;;
+    esac
+done
+
+dir=$(dirname "$0")/..
+tmp=${TMPDIR:-/tmp}/ramcheck.$$
+trap 'rm -f "$tmp.c" "$tmp.o"' EXIT
+
+# STACK_BYTES depends on options, so it becomes the size of an array
+printf '#include "main.c"\nchar ramcheck_stack[STACK_BYTES];\n' >"$tmp.c"
+${CC:-cc} -m32 -ffreestanding -fno-pic -Os -fno-common -w -I"$dir" -I"$dir/Tools/sim" \
+    "$@" -c -o "$tmp.o" "$tmp.c" || exit 1
+
+nm -S -t d --size-sort "$tmp.o" |
+awk -v ram="$ram" -v verbose="$verbose" '
+$4 == "ramcheck_stack" { stack = $2; next }
+# Information memory, in flash
+$4 == "pllsaved" || $4 == "metersaved" { next }
+NF == 4 && $3 ~ /^[bBdD]$/ {
+    vars += $2
+    if (verbose) printf "%5d %s\n", $2, $4
+}
+NF == 4 && $3 ~ /^[rR]$/ { tables += $2 }
+END {
+    vars += vars % 2
+    printf "Variables %d, stack %d, total %d of %d bytes of RAM\n",
+           vars, stack, vars + stack, ram
+    printf "Constant tables %d bytes of flash\n", tables
+    if (vars + stack > ram) {
+        printf "RAM overflows by %d bytes\n", vars + stack - ram
+        exit 1
+    }
+}'
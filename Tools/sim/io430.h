@@ -0,0 +1,149 @@
+/* Stub io430.h for compiling MSPAC firmware on a host
+ *
+ * Peripheral registers are plain variables owned by the simulator in
+ * mspacsim.c, and IAR intrinsics call into the simulator. Only the registers
+ * and bits used by main.c are provided. Bit values match the MSP430x2xx
+ * family headers.
+ */
+
+#ifndef SIM_IO430_H
+#define SIM_IO430_H
+
+/*** Compiler extensions ***/
+#define __interrupt
+#define __cc_version2
+#define __even_in_range(x, y) (x)
+#define __no_init
+#define __task
+
+void sim_bis_sr(unsigned short bits);
+void sim_bic_sr_on_exit(unsigned short bits);
+void sim_bis_sr_on_exit(unsigned short bits);
+unsigned short sim_get_sr_on_exit(void);
+void sim_enable_interrupt(void);
+void sim_disable_interrupt(void);
+
+#define __bis_SR_register(x) sim_bis_sr(x)
+#define __bic_SR_register_on_exit(x) sim_bic_sr_on_exit(x)
+#define __bis_SR_register_on_exit(x) sim_bis_sr_on_exit(x)
+#define __get_SR_register_on_exit() sim_get_sr_on_exit()
+#define __enable_interrupt() sim_enable_interrupt()
+#define __disable_interrupt() sim_disable_interrupt()
+
+/*** Status register ***/
+#define GIE 0x0008
+#define CPUOFF 0x0010
+#define OSCOFF 0x0020
+#define SCG0 0x0040
+#define SCG1 0x0080
+
+#define LPM0_bits (CPUOFF)
+#define LPM1_bits (SCG0 | CPUOFF)
+#define LPM2_bits (SCG1 | CPUOFF)
+#define LPM3_bits (SCG1 | SCG0 | CPUOFF)
+#define LPM4_bits (SCG1 | SCG0 | OSCOFF | CPUOFF)
+
+/*** Watchdog and clocks ***/
+extern volatile unsigned short WDTCTL;
+#define WDTPW 0x5A00
+#define WDTHOLD 0x0080
+
+extern volatile unsigned char DCOCTL, BCSCTL1, BCSCTL3;
+extern const volatile unsigned char CALBC1_1MHZ, CALDCO_1MHZ;
+extern const volatile unsigned char CALBC1_8MHZ, CALDCO_8MHZ;
+extern const volatile unsigned char CALBC1_16MHZ, CALDCO_16MHZ;
+#define DCO0 0x20
+#define DCO1 0x40
+#define DCO2 0x80
+
+// BCSCTL3
+#define LFXT1S_2 0x20
+
+/*** Flash controller ***/
+// Accessing FCTL1 lets the simulator apply the previous erase or write
+volatile unsigned short *sim_fctl1(void);
+#define FCTL1 (*sim_fctl1())
+extern volatile unsigned short FCTL2, FCTL3;
+#define FWKEY 0xA500
+
+// FCTL1
+#define ERASE 0x0002
+#define WRT 0x0040
+
+// FCTL2
+#define FN1 0x0002
+#define FSSEL_1 0x0040
+
+// FCTL3
+#define LOCK 0x0010
+
+/*** Port 1 and 2 ***/
+extern volatile unsigned char P1IN, P1OUT, P1DIR, P1IFG, P1IES, P1IE;
+extern volatile unsigned char P1SEL, P1REN;
+extern volatile unsigned char P2OUT, P2DIR, P2SEL, P2REN;
+
+/*** Timer_A ***/
+extern volatile unsigned short TAIV;
+
+// Accessing TACTL lets the simulator apply TACLR from the previous write
+volatile unsigned short *sim_tactl(void);
+#define TACTL (*sim_tactl())
+
+// Reading TAR lets a timer cycle pass, so firmware can busy-wait on it
+volatile unsigned short *sim_tar(void);
+#define TAR (*sim_tar())
+extern volatile unsigned short TACCTL0, TACCTL1, TACCR0, TACCR1;
+
+// TACTL
+#define TAIFG 0x0001
+#define TAIE 0x0002
+#define TACLR 0x0004
+#define MC_0 0x0000
+#define MC_1 0x0010
+#define MC_2 0x0020
+#define MC_3 0x0030
+#define ID_0 0x0000
+#define ID_1 0x0040
+#define ID_2 0x0080
+#define ID_3 0x00C0
+#define TASSEL_1 0x0100
+#define TASSEL_2 0x0200
+
+// TACCTLx
+#define CCIFG 0x0001
+#define COV 0x0002
+#define OUT 0x0004
+#define CCI 0x0008
+#define CCIE 0x0010
+#define OUTMOD_0 0x0000
+#define OUTMOD_1 0x0020
+#define OUTMOD_5 0x00A0
+#define OUTMOD_7 0x00E0
+#define CAP 0x0100
+#define SCS 0x0800
+#define CCIS_0 0x0000
+#define CCIS_1 0x1000
+#define CM_1 0x4000
+#define CM_2 0x8000
+#define CM_3 0xC000
+
+/*** ADC10 ***/
+extern volatile unsigned short ADC10CTL0, ADC10CTL1, ADC10MEM, ADC10SA;
+extern volatile unsigned char ADC10AE0, ADC10DTC0, ADC10DTC1;
+
+// ADC10CTL0
+#define ADC10SC 0x0001
+#define ENC 0x0002
+#define ADC10IFG 0x0004
+#define ADC10IE 0x0008
+#define ADC10ON 0x0010
+#define MSC 0x0080
+#define ADC10SHT_3 0x1800
+
+// ADC10CTL1
+#define CONSEQ_2 0x0004
+#define ADC10SSEL_0 0x0000
+#define ADC10SSEL_3 0x0018
+#define ADC10DIV_7 0x00E0
+
+#endif /* SIM_IO430_H */
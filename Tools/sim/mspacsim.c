@@ -0,0 +1,2295 @@
+/* MSPAC host simulation
+ *
+ * The real main.c is compiled against the stub io430.h in this directory.
+ * Timer_A, port 1 and ADC10 are simulated on a virtual SMCLK, and a
+ * synthetic optocoupler waveform drives the zero crossing detector. The
+ * simulation is event driven and firmware code takes zero time, so hours
+ * of AC cycles are simulated per second of wall clock time. Times are in
+ * timer ticks, which are SMCLK cycles divided by the firmware's TIMER_DIV.
+ *
+ * Build: cc -O2 -I. -o mspacsim mspacsim.c -lm
+ *
+ * Usage: mspacsim [-d seconds] [-f mains_hz] [-c smclk_hz] [-j jitter_ticks]
+ *                 [-m miss_prob] [-g glitch_prob] [-b bounce_ticks]
+ *                 [-i isr_ticks] [-w work_ticks] [-p pot_code]
+ *                 [-a adc_noise] [-s seed] [-t trace.csv] [-x serial.bin]
+ *                 [-r replay.bin] [-D delays.txt] [-F flash.bin]
+ *                 [-v vlo_hz] [-L wake_ticks] [-A cycles] [-G gate_ma]
+ *                 [-S cases] [-e time:action]...
+ * Options -j, -m and -g make optocoupler edges noisy, with Gaussian jitter,
+ * missing pulses and spurious short pulses between real ones. Option -b
+ * makes the output revert once for a random time within bounce_ticks
+ * after each real edge, which the firmware should blank out.
+ * Actions are off, auto, on (switch position), trig (200 ms trigger pulse)
+ * and pot=N (new ADC10 code). Events at time 0 set initial input levels.
+ * Actions sw=off, sw=auto, sw=on, trig=down and trig=up change an input
+ * once, without contact bounce.
+ * Option -a adds Gaussian noise to ADC10 samples, with sigma in codes.
+ * Build with -DPOT_OVERSAMPLE=0 for one pot sample per AC cycle. Build
+ * with -DSMCLK_MHZ=8 or 16 and -DMAINS_HZ=50 or 60 for other firmware clock
+ * and mains settings. Option -c defaults to the firmware's SMCLK_HZ.
+ * Build with -DBURST_FIRE for integral cycle control. Instead of power vs
+ * the dimming curve, it reports AC cycles conducting while steady vs
+ * dimpower, bursts of conducting half-cycles that weren't whole cycles,
+ * and the largest difference between positive and negative half-cycles
+ * conducted.
+ * Build with -DPOT_DIRECT to follow the pot through the composite table in
+ * pottab.h.
+ *
+ * Add -DSERIAL_BAUD=9600 to the build to simulate a host on the serial
+ * line. It decodes telemetry frames and checks bit timing. Actions dim=N
+ * (0 to 127 for full power) and fade=N (fade time in 1/10 s, up to 127)
+ * queue commands, which are sent after the next frame.
+ *
+ * Option -x saves bytes sent by the firmware to a file. With -DTRACE too,
+ * the firmware sends trace records instead of telemetry, so commands are
+ * never sent. Option -r replays a trace in any build, instead of the
+ * synthetic optocoupler, pot and events, and stops at the end of the trace.
+ * Option -D writes the number of falling zero crossing captures, channel
+ * and triacdelay at firings where triacdelay changed, for comparing builds
+ * replaying the same trace.
+ *
+ * Option -F loads information memory from a file, if it exists, and saves
+ * it at the end, so the saved mains period carries over to the next run.
+ * Otherwise it starts erased. Replaying a trace needs the image the
+ * recording started with. Edges until the PLL estimate and the first
+ * firing are correct are counted from each zero crossing detection start.
+ *
+ * Interrupts normally take zero time. Options -i and -w model interrupt run
+ * time, and case 6 of TACCR1_ISR taking longer, delaying other interrupts.
+ * Add -DISR_PROFILE to the build to also print the firmware's isrprof,
+ * and -DUPDATE_STATS for updstats, with savings per simulated minute.
+ * With -DWORK_STATS, deferred case 6 tasks and overruns in workstats are
+ * printed if any.
+ * Build with -DENERGY_METER to print the firmware's energy meter, which
+ * carries over between runs with -F, and the energy delivered in this run
+ * from firing angles, or half-cycles conducting with burst fire.
+ *
+ * Supply current is estimated from time in each low power mode, ADC10
+ * conversions and TRIAC gate drive at -G milliamps. Each interrupt and
+ * main loop wakeup is assumed to run for -A CPU cycles. Build with
+ * -DLPM3_IDLE for tickless idle. The VLO runs at -v Hz, and leaving LPM3
+ * or LPM4 delays interrupts by -L ticks, which defaults to the firmware's
+ * IDLE_WAKE. Replay isn't supported in that build.
+ *
+ * With phase control, power at the firing angle converted after each fade
+ * step is compared with the fade's curve between its endpoints, and
+ * reported by curve.
+ *
+ * Every run checks invariants: no TRIAC fires in STATE_OFF after the fade,
+ * the LED is on while a TRIAC gate is, the switch can always change state
+ * through port 1 interrupts or debouncing, and state follows the switch
+ * once inputs are quiet. Option -S runs that many stress test cases instead,
+ * each from reset with random switch and trigger changes, mostly contact
+ * bounce. The first failing case is shrunk to fewer events, and printed as
+ * a command line reproducing it with the same build and other options.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "io430.h"
+
+/*** Firmware ***/
+
+#define main mspac_main
+#include "../../main.c"
+#undef main
+#undef TAR
+#undef TACTL
+#undef FCTL1
+
+static unsigned long mult_calls;
+
+// Bit exact emulation of mult.asm, same as Tools/mult.c
+static unsigned short sim_mult(unsigned short r12, unsigned short r13)
+{
+    unsigned short c1, c2, r14 = r12;
+
+    r12 = 0;
+
+    c1 = r13 & 1;
+
+    r13 >>= 1;
+    r13 += c1;
+
+    c1 = 1;
+    while (1) {
+        c2 = r14 & 1;
+        r14 = (r14 >> 1) | (c1 ? 0x8000 : 0);
+        c1 = 0;
+
+        if (!c2) {
+            r12 >>= 1;
+        } else if (r14 == 0) {
+            break;
+        } else {
+            r12 >>= 1;
+            r12 += r13;
+        }
+    }
+
+    return r12;
+}
+
+unsigned short mult(unsigned short a, unsigned short b)
+{
+    mult_calls++;
+    return sim_mult(a, b);
+}
+
+/*** Simulated registers ***/
+
+volatile unsigned short WDTCTL;
+volatile unsigned short FCTL1, FCTL2, FCTL3;
+volatile unsigned char DCOCTL, BCSCTL1, BCSCTL3;
+const volatile unsigned char CALBC1_1MHZ = 0x86, CALDCO_1MHZ = 0xB5;
+const volatile unsigned char CALBC1_8MHZ = 0x8D, CALDCO_8MHZ = 0x92;
+const volatile unsigned char CALBC1_16MHZ = 0x8F, CALDCO_16MHZ = 0x95;
+volatile unsigned char P1IN, P1OUT, P1DIR, P1IFG, P1IES, P1IE;
+volatile unsigned char P1SEL, P1REN;
+volatile unsigned char P2OUT, P2DIR, P2SEL, P2REN;
+volatile unsigned short TACTL, TAR, TAIV;
+volatile unsigned short TACCTL0, TACCTL1, TACCR0, TACCR1;
+volatile unsigned short ADC10CTL0, ADC10CTL1, ADC10MEM, ADC10SA;
+volatile unsigned char ADC10AE0, ADC10DTC0, ADC10DTC1;
+
+// Unused bit of TACCTL0, marking register rewrites
+#define SIM_UNWRITTEN 0x0200
+
+/*** Simulation parameters ***/
+
+static double clk_hz = SMCLK_HZ;   // SMCLK frequency
+static double tick_hz;             // Timer frequency, SMCLK / TIMER_DIV
+static double mains_hz = 60.0;     // Mains frequency
+static double opto_thresh = 0.25;  // Optocoupler threshold, fraction of peak
+static double edge_jitter = 0;     // Optocoupler edge noise sigma, in ticks
+static double miss_prob = 0;       // Probability of missing optocoupler pulse
+static double glitch_prob = 0;     // Probability of spurious pulse per cycle
+static double glitch_len = 100;    // Length of spurious pulse, in ticks
+static double bounce_len = 0;      // Bounce after real edges, in ticks
+static double duration = 60.0;     // Simulated time, in seconds
+static unsigned short pot = 512;   // ADC10 code for potentiometer
+static double adc_noise = 0;       // ADC10 sample noise sigma, in codes
+static unsigned int isr_cost;      // Run time of each interrupt, in ticks
+static unsigned int work_cost;     // Extra run time of TACCR1 periodic work
+#ifdef LPM3_IDLE
+static unsigned int wake_cost = IDLE_WAKE; // LPM3 and LPM4 wake to ISR code,
+                                   // in ticks
+#else
+static unsigned int wake_cost;
+#endif
+static double vlo_hz = 12000;      // VLO frequency, 4 to 20 kHz
+static unsigned int act_cycles = 100; // Assumed CPU cycles of each interrupt
+                                   // and wakeup, for supply current
+static double gate_ma = 0;         // TRIAC gate drive current
+static uint64_t seed = 1;
+static FILE *tracef;
+static FILE *serf;                 // Bytes sent by firmware
+static FILE *replayf;              // Trace being replayed
+static FILE *delayf;               // Log of triacdelay changes
+static const char *flashname;      // Information memory image
+
+/*** Simulation state ***/
+
+static uint64_t now;               // Time in SMCLK ticks since reset
+static uint64_t ticks;             // Timer ticks since reset, TAR unwrapped
+static uint64_t end_time;
+static jmp_buf sim_exit;
+
+static unsigned short sim_sr;      // Status register
+static unsigned short isr_sr;      // Status register saved on ISR entry
+static unsigned char gates;        // TRIAC gate outputs, bit per channel
+static uint64_t gate_on[CHANNELS]; // Time gate was turned on
+static unsigned short ccr0_last;   // TACCR0 value seen by sim_sync()
+static uint64_t ccr0_t;            // Time of TA0.0 compare not reloaded yet
+static bool ccr0_pending;
+static double vlo_per;             // VLO period, in ticks
+static uint64_t vlo_k;             // Number of next VLO rising edge
+static uint64_t vlo_next;          // Time of it
+
+// Optocoupler
+static double mains_period;        // AC period, in ticks
+static double mains_phase;         // Time of a positive-going zero crossing
+static double opto_ofs;            // Activation delay after zero crossing
+static uint64_t opto_next;         // Time of next edge
+static uint64_t opto_cycle;        // AC cycle of next edge
+static bool opto_fall;             // Next edge is falling (activation)
+static bool opto_glitch;           // Next edge is of spurious pulse
+static double glitch_t;            // Time of spurious pulse
+static uint64_t bounce_t[2];       // Times of bounce edges
+static unsigned char bounce_n;     // Bounce edges left
+
+// Scripted inputs
+#define EV_P1IN 0
+#define EV_POT 1
+#define EV_SERCMD 2
+struct simevent {
+    uint64_t t;
+    unsigned char kind;
+    unsigned char mask;
+    unsigned short val;
+};
+static struct simevent *events;
+static unsigned int nevents, evalloc, evnext;
+
+// Statistics
+static struct {
+    unsigned long isr_ccr0, isr_ccr1, isr_port1, isr_adc10;
+    unsigned long wakeups, firings;
+    unsigned long chfirings[CHANNELS];
+    unsigned long missed, glitches;     // Optocoupler noise
+    unsigned long bounces, bounce_caught;   // Bounces, and edges of them
+                                            // captured
+    unsigned long unlocked;             // Firings while PLL not locked
+    unsigned long pulses;
+    uint64_t pulse_sum, pulse_min, pulse_max;   // Gate pulse length
+    unsigned long reloads;
+    uint64_t reload_sum, reload_max;    // TA0.0 compare to TACCR0 reload
+    double err_sum, err_sq, err_max;    // Firing time vs triacdelay, in ticks
+    unsigned long perr_n;
+    double perr_sq, perr_max;           // Delivered vs analytic power
+    unsigned long ser_frames, ser_bad;  // Telemetry frames, and bad bytes
+    unsigned long ser_cmds;             // Commands sent
+    unsigned long ser_bytes;            // Trace bytes
+    double ser_edge_max;                // Bit edge vs host baud, in ticks
+    unsigned long fades, fade_missed;   // Completed fades, and those not
+                                        // ending at fadetarget
+    double fade_err_max;                // Fade length vs fadelen, in cycles
+    unsigned long fpow_n[FADE_NONE];
+    double fpow_sq[FADE_NONE], fpow_max[FADE_NONE]; // Power along fades
+                                        // vs their curve, by curve
+    double pot_settle_max;              // Pot change to potavg within
+                                        // 2 codes, in seconds
+    unsigned long pot_n;
+    double pot_sq, pot_max;             // Settled potavg error, in codes
+    unsigned long flash_saves, flash_erases, flash_bad;
+#ifdef ENERGY_METER
+    double energy;                      // Channel 0 half-cycles conducting,
+                                        // weighted by power
+#endif
+    unsigned long zc_starts;            // Zero crossing detection starts
+    unsigned long zc_valid_sum, zc_valid_max;   // Edges until hperiod and
+                                                // PLL phase are valid
+    unsigned long zc_fire_sum, zc_fire_max;     // Edges until first firing
+                                                // at correct time
+#ifdef BURST_FIRE
+    unsigned long burst_n;              // Steady AC cycles sampled
+    unsigned long burst_on[CHANNELS];   // Sampled cycles conducting
+    double burst_want[CHANNELS];        // Cycles dimpower asked for
+    long burst_dc[CHANNELS];            // Positive minus negative half-cycles
+    unsigned long burst_odd;            // Bursts not whole cycles
+#endif
+    uint64_t mode_t[4];                 // Time in active mode, LPM0, LPM3
+                                        // and LPM4, in ticks
+    double isr_t[4];                    // Assumed run time of interrupts
+                                        // and wakeups from each mode
+    uint64_t gate_t;                    // Gate drive, summed over channels
+    double adc_t;                       // ADC10 converting
+    unsigned long idles;                // Returns to LPM3 from an ISR
+} st;
+
+// Pot tracking
+static uint64_t pot_t;             // Time of last pot change or turning on
+static bool pot_settled;
+
+// Invariants
+#define INV_OFF_FIRE 1             // TRIAC fired in STATE_OFF after fade
+#define INV_LED 2                  // TRIAC on with LED off
+#define INV_DEAF 3                 // Switch can't change state
+#define INV_STATE 4                // State doesn't follow quiet switch
+#define INV_CRASH 5                // Stress test case didn't finish
+struct violation {
+    int inv;
+    double t;                      // Time, in seconds
+    char msg[120];
+};
+static unsigned long violations;
+static struct violation viol_first;
+static struct violation *stress_res; // Shared with parent of stress case
+static uint64_t input_t;           // Time of last switch or trigger change
+static bool led_bad;               // TRIAC on with LED off, counted once
+
+#ifdef FADES
+// Fade being timed, and its parameters for noticing a new one
+static bool fade_timing;
+static unsigned short fade_lastfrom, fade_lasttarget, fade_lastlen;
+static bool fade_lastfading;
+#ifndef BURST_FIRE
+static unsigned short fade_lastpos;
+#endif
+static uint64_t fade_t0;
+#endif
+
+// Trace replay, with predictor state as in firmware
+#define RP_END 0
+#define RP_EDGE 1
+#define RP_INPUT 2
+#define RP_POTQ 64                 // Pot readings queued, a power of 2
+static struct {
+    unsigned short last[2], per[2], pot;
+    unsigned char kind;            // Next timed record
+    unsigned char val;             // Edge, or inputs with TRACE_WOKEN
+    uint64_t tick;                 // Time of next timed record
+    unsigned short potq[RP_POTQ];
+    unsigned int pothead, pottail;
+    unsigned long records, lost;
+    bool stuck;                    // Firmware diverged from trace
+} rp;
+static unsigned short delay_last[CHANNELS];
+static unsigned long zc_falls;     // Falling edges captured
+
+// Zero crossing detection start, waiting for valid estimate and firing
+static bool zc_on, zc_wait_valid, zc_wait_fire;
+static unsigned long zc_start;     // zc_falls when detection started
+
+// Information memory as programmed, to check firmware stores against
+#ifdef ENERGY_METER
+static unsigned char flash[sizeof(pllsaved) + sizeof(metersaved)];
+#else
+static unsigned char flash[sizeof(pllsaved)];
+#endif
+
+#ifdef SERIAL_BAUD
+// Serial host
+static double ser_bitlen;          // Bit length, in ticks
+static bool ser_line = true;       // Line level
+static uint64_t ser_start;         // Start bit of byte being decoded
+static uint64_t ser_sample = UINT64_MAX; // Time of next decoder sample
+static unsigned char ser_nbit, ser_byte;
+static unsigned char ser_frame[SER_FRAMELEN], ser_last[SER_FRAMELEN];
+static unsigned int ser_flen;
+static unsigned char host_q[256];  // Command bytes to send
+static unsigned char host_qhead, host_qtail;
+static double host_t;              // Time of next bit sent by host
+static uint64_t host_next = UINT64_MAX;
+static unsigned short host_shift;
+static unsigned char host_bits;
+static bool host_level = true;
+#endif
+
+/*** Random numbers ***/
+
+static uint64_t rand_next(void)
+{
+    // xorshift64*
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 2685821657736338717ULL;
+}
+
+static double rand_uniform(void)
+{
+    return (rand_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rand_gauss(void)
+{
+    double u = rand_uniform();
+
+    if (u < 1e-300) u = 1e-300;
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * rand_uniform());
+}
+
+#ifndef BURST_FIRE
+/*** Dimming curve, same as Tools/dimtab.c ***/
+
+static double angle2power(double angle)
+{
+    return 0.5*angle - 0.25*sin(angle*2.0);
+}
+
+// Power fraction that dimtab was generated for, as a function of dimpower
+static double dimpower2power(unsigned short dp)
+{
+    double p = DIMTAB_P0 + (1.0 - DIMTAB_P0) * dp / 65536.0;
+    return p * p;
+}
+
+#ifdef FADES
+// Fraction of power range at time t of fade, same as Tools/dimtab.c
+static double fade_power(unsigned char curve, double t)
+{
+    double l = 100.0 * t;
+
+    switch (curve) {
+    case FADE_LINEAR:
+        return t;
+    case FADE_PERCEPTUAL:
+        return l > 8.0 ? pow((l + 16.0) / 116.0, 3.0) : l / 903.3;
+    default:
+        return t * t * (3.0 - 2.0 * t);
+    }
+}
+#endif // FADES
+#endif
+
+/*** Invariants ***/
+
+static void violation(int inv, const char *fmt, ...)
+{
+    struct violation v;
+    va_list ap;
+
+    v.inv = inv;
+    v.t = now / tick_hz;
+    va_start(ap, fmt);
+    vsnprintf(v.msg, sizeof(v.msg), fmt, ap);
+    va_end(ap);
+
+    // Stress test case ends at the first one
+    if (stress_res) {
+        *stress_res = v;
+        _exit(1);
+    }
+    if (violations++ == 0) viol_first = v;
+}
+
+/*** Peripherals ***/
+
+// VLO rising edges are at whole ticks, and computed the same way everywhere
+static uint64_t vlo_edge(uint64_t k)
+{
+    return (uint64_t)ceil((k + 0.5) * vlo_per);
+}
+
+static bool timer_aclk(void)
+{
+    return (TACTL & (TASSEL_1 | TASSEL_2)) == TASSEL_1;
+}
+
+// SCG1 turns off SMCLK, and OSCOFF turns off ACLK
+static bool timer_running(void)
+{
+    if (!(TACTL & MC_3)) return false;
+    return (sim_sr & (timer_aclk() ? OSCOFF : SCG1)) == 0;
+}
+
+// Ticks until TAR counts to ccr, 1 to 0x10000 timer clocks
+static uint64_t compare_delay(unsigned short ccr)
+{
+    uint64_t n = (unsigned short)(ccr - TAR - 1) + 1;
+
+    return timer_aclk() ? vlo_edge(vlo_k + n - 1) - now : n;
+}
+
+// Active mode, LPM0, LPM3 and LPM4, for supply current
+static int power_mode(void)
+{
+    if (!(sim_sr & CPUOFF)) return 0;
+    if (sim_sr & OSCOFF) return 3;
+    return sim_sr & SCG1 ? 2 : 1;
+}
+
+static void advance(uint64_t t)
+{
+    unsigned char ch;
+
+    st.mode_t[power_mode()] += t - now;
+    for (ch = 0; ch < CHANNELS; ch++) {
+        if (gates & (1 << ch)) st.gate_t += t - now;
+    }
+    if (timer_running()) {
+        if (!timer_aclk()) {
+            TAR += (unsigned short)(t - now);
+            ticks += t - now;
+        }
+    }
+    while (vlo_next <= t) {
+        if (timer_running() && timer_aclk()) {
+            TAR++;
+            ticks++;
+        }
+        vlo_next = vlo_edge(++vlo_k);
+    }
+    now = t;
+}
+
+static void opto_schedule(void)
+{
+    static uint64_t last, planned = UINT64_MAX;
+    double t;
+
+    // Decide on noise once per real pulse
+    if (opto_fall && !opto_glitch && opto_cycle != planned) {
+        while (miss_prob > 0 && rand_uniform() < miss_prob) {
+            opto_cycle++;
+            st.missed++;
+        }
+        planned = opto_cycle;
+        if (glitch_prob > 0 && rand_uniform() < glitch_prob) {
+            // Somewhere in the inactive half-cycle before the real pulse
+            glitch_t = mains_phase + opto_cycle * mains_period -
+                       rand_uniform() * (mains_period / 2 - glitch_len);
+            opto_glitch = true;
+            st.glitches++;
+        }
+    }
+
+    if (opto_glitch) {
+        t = glitch_t + (opto_fall ? 0 : glitch_len);
+    } else {
+        t = mains_phase + opto_cycle * mains_period;
+        t += opto_fall ? opto_ofs : mains_period / 2 - opto_ofs;
+        if (edge_jitter > 0) t += rand_gauss() * edge_jitter;
+    }
+
+    opto_next = (t <= last) ? last + 1 : (uint64_t)llround(t);
+    last = opto_next;
+}
+
+#ifdef BURST_FIRE
+// Last half-cycle conducting, and length of the burst it ended, by channel
+static double burst_lastk[CHANNELS];
+static unsigned long burst_run[CHANNELS];
+
+/* Count half-cycles conducting while gate of channel was on until now. The
+ * TRIAC turns on if the gate is on while voltage is above about the
+ * optocoupler threshold, and conducts until the end of the half-cycle.
+ * Consecutive ones form a burst, which is counted when a later one doesn't
+ * continue it. */
+static void burst_halves(unsigned char ch)
+{
+    double hp = mains_period / 2;
+    double k = floor((gate_on[ch] - mains_phase) / hp);
+
+    for (;; k++) {
+        double z = mains_phase + k * hp;
+
+        if (z + opto_ofs > now) break;
+        if (z + hp - opto_ofs < gate_on[ch]) continue;
+        if (burst_run[ch] && k <= burst_lastk[ch]) continue;
+        st.burst_dc[ch] += fmod(k, 2) == 0 ? 1 : -1;
+#ifdef ENERGY_METER
+        if (ch == 0) st.energy += 1;
+#endif
+        if (burst_run[ch] && k == burst_lastk[ch] + 1) {
+            burst_run[ch]++;
+        } else {
+            if (burst_run[ch] & 1) st.burst_odd++;
+            burst_run[ch] = 1;
+        }
+        burst_lastk[ch] = k;
+    }
+}
+
+// At start of each real AC cycle, see if channels conduct in it
+static void burst_sample(void)
+{
+    unsigned char ch;
+
+    if (state != STATE_ON || fading || replayf) return;
+    st.burst_n++;
+    for (ch = 0; ch < CHANNELS; ch++) {
+        unsigned short chdim = chscale[ch] == 0xFFFF ? dimpower :
+                               sim_mult(dimpower, chscale[ch]);
+
+        st.burst_want[ch] += chdim / 65536.0;
+        if (gates & (1 << ch)) st.burst_on[ch]++;
+    }
+}
+#endif
+
+// Record end of gate pulse of channel at current time
+static void gate_off(unsigned char ch)
+{
+    uint64_t len = now - gate_on[ch];
+
+    if (!(gates & (1 << ch))) return;
+    gates &= ~(1 << ch);
+#ifdef BURST_FIRE
+    if (!replayf) burst_halves(ch);
+#endif
+    st.pulse_sum += len;
+    if (st.pulses++ == 0 || len < st.pulse_min) st.pulse_min = len;
+    if (len > st.pulse_max) st.pulse_max = len;
+}
+
+// Time vs nearest peak of waveform, in ticks
+static double peak_err(double t)
+{
+    double hp = mains_period / 2;
+    double err = fmod(t - mains_phase - mains_period / 4, hp);
+
+    if (err > hp / 2) err -= hp;
+    else if (err < -hp / 2) err += hp;
+    return err;
+}
+
+// Record a TRIAC firing of channel at current time
+static void gate_fire(unsigned char ch)
+{
+    double hp = mains_period / 2;
+    double delay = fmod(now - mains_phase + mains_period, hp);
+    double err = delay - triacdelay[ch];
+
+    if (gates & (1 << ch)) return;
+    gates |= 1 << ch;
+    if (state == STATE_OFF && !fading) {
+        violation(INV_OFF_FIRE, "TRIAC %u fired in STATE_OFF after fade", ch);
+    }
+
+    // Wrap to nearest zero crossing
+    if (err > hp / 2) err -= hp;
+    else if (err < -hp / 2) err += hp;
+
+    // Log triacdelay used by firings, when it changes
+    if (delayf && triacdelay[ch] != delay_last[ch]) {
+        delay_last[ch] = triacdelay[ch];
+        fprintf(delayf, "%lu %u %u\n", zc_falls, ch, triacdelay[ch]);
+    }
+
+    // First firing since detection started, if at the right time
+    if (zc_wait_fire && fabs(err) <= hp / 100) {
+        unsigned long edges = zc_falls - zc_start;
+
+        zc_wait_fire = false;
+        st.zc_fire_sum += edges;
+        if (edges > st.zc_fire_max) st.zc_fire_max = edges;
+    }
+
+    gate_on[ch] = now;
+    st.firings++;
+    st.chfirings[ch]++;
+    if (plllock < PLL_LOCKED) st.unlocked++;
+    // Replayed zero crossings aren't from the synthetic waveform
+    if (!replayf) {
+        st.err_sum += err;
+        st.err_sq += err * err;
+        if (fabs(err) > st.err_max) st.err_max = fabs(err);
+    }
+
+#if defined(ENERGY_METER) && !defined(BURST_FIRE)
+    if (ch == 0) st.energy += angle2power(M_PI * (1.0 - delay / hp)) /
+                              (M_PI / 2);
+#endif
+#ifndef BURST_FIRE
+    if (state == STATE_ON && !fading && !replayf) {
+        double power = angle2power(M_PI * (1.0 - delay / hp)) / (M_PI / 2);
+        unsigned short chdim = chscale[ch] == 0xFFFF ? dimpower :
+                               sim_mult(dimpower, chscale[ch]);
+        double perr = power - dimpower2power(chdim);
+
+        st.perr_n++;
+        st.perr_sq += perr * perr;
+        if (fabs(perr) > st.perr_max) st.perr_max = fabs(perr);
+    }
+#endif
+
+    if (tracef) {
+        fprintf(tracef, "%.6f,%u,%u,%u,%u,%.1f,%.1f,%u\n",
+                now / tick_hz, state, dimpower, triacdelay[ch], hperiod,
+                delay, err, ch);
+    }
+}
+
+#ifdef SERIAL_BAUD
+// Follow serial line, starting decoding at start bits sent by firmware
+static void ser_sync(void)
+{
+    bool level = (P1DIR & P1_SERIAL) ? (P1OUT & P1_SERIAL) != 0 : host_level;
+    double pos, err;
+
+    if (level == ser_line) return;
+    ser_line = level;
+
+    if (ser_sample == UINT64_MAX) {
+        if (!level && (P1DIR & P1_SERIAL)) {
+            ser_start = now;
+            ser_nbit = 0;
+            ser_sample = now + llround(1.5 * ser_bitlen);
+        }
+        return;
+    }
+
+    // Edge vs nearest bit boundary, timed from start bit
+    pos = now - ser_start;
+    err = pos - floor(pos / ser_bitlen + 0.5) * ser_bitlen;
+    if (fabs(err) > st.ser_edge_max) st.ser_edge_max = fabs(err);
+}
+#endif
+
+// Handle effects of firmware register writes
+// ADC10 code for pot, with noise
+static unsigned short adc_sample(void)
+{
+    long v = lround(pot + adc_noise * rand_gauss());
+
+    return v < 0 ? 0 : v > 0x3FF ? 0x3FF : v;
+}
+
+static void timer_clear(void)
+{
+    if (TACTL & TACLR) {
+        ticks += (unsigned short)-TAR;
+        TAR = 0;
+        TACTL &= ~TACLR;
+    }
+}
+
+static void sim_sync(void)
+{
+    unsigned char ch;
+    bool zc = (TACCTL1 & CCIE) != 0;
+
+#ifdef LPM3_IDLE
+    // Detection pauses while idle
+    if (idlemode != IDLE_OFF) zc = zc_on;
+#endif
+    // Detection starts at reset, and leaving LPM4
+    if (zc && (TACCTL1 & CAP) && !zc_on) {
+        zc_start = zc_falls;
+        zc_wait_valid = zc_wait_fire = !replayf;
+        st.zc_starts++;
+    }
+    zc_on = zc;
+
+    timer_clear();
+
+    /* Firmware sets TA0.0 output with OUTMOD_0, and only sets up OUTMOD_1
+     * after turning it off. OUTMOD_5 is set up while it is on. */
+    if (!(TACCTL0 & SIM_UNWRITTEN)) {
+        if ((TACCTL0 & OUTMOD_7) == OUTMOD_0 && (TACCTL0 & OUT)) {
+            gate_fire(0);
+        } else if ((TACCTL0 & OUTMOD_7) != OUTMOD_5) {
+            gate_off(0);
+        }
+        TACCTL0 |= SIM_UNWRITTEN;
+    }
+
+    // Port 2 gates of other channels
+    for (ch = 1; ch < CHANNELS; ch++) {
+        if (P2OUT & P2DIR & chbit[ch]) gate_fire(ch);
+        else gate_off(ch);
+    }
+    if (gates && !(P1OUT & P1_LED)) {
+        if (!led_bad) {
+            violation(INV_LED, "TRIAC on with LED off, gates 0x%02X", gates);
+        }
+        led_bad = true;
+    } else {
+        led_bad = false;
+    }
+
+    if (ccr0_pending && TACCR0 != ccr0_last) {
+        uint64_t lat = now - ccr0_t;
+
+        ccr0_pending = false;
+        st.reloads++;
+        st.reload_sum += lat;
+        if (lat > st.reload_max) st.reload_max = lat;
+    }
+    ccr0_last = TACCR0;
+
+#ifdef SERIAL_BAUD
+    ser_sync();
+#endif
+
+    // Conversion or DTC block finishes long before the next AC cycle reads
+    // it. The DTC start address is not simulated, because the only block
+    // is potbuf.
+    if ((ADC10CTL0 & (ADC10ON | ENC | ADC10SC)) ==
+        (ADC10ON | ENC | ADC10SC)) {
+        // Sample and hold of 4 to 64 ADC10CLK cycles, and 13 to convert.
+        // ADC10OSC is about 5 MHz, and ADC10SSEL_2 or 3 is SMCLK.
+        static const unsigned char sht[4] = { 4, 8, 16, 64 };
+        double conv = (sht[ADC10CTL0 >> 11 & 3] + 13) *
+                      ((ADC10CTL1 >> 5 & 7) + 1) * tick_hz /
+                      ((ADC10CTL1 & 0x0018) ? clk_hz : 5e6);
+#if POT_OVERSAMPLE
+        unsigned char i;
+
+        for (i = 0; i < ADC10DTC1; i++) potbuf[i] = adc_sample();
+        st.adc_t += ADC10DTC1 * conv;
+#else
+        st.adc_t += conv;
+#endif
+        ADC10MEM = adc_sample();
+        ADC10CTL0 = (ADC10CTL0 & ~ADC10SC) | ADC10IFG;
+    }
+}
+
+
+static void set_p1in(unsigned char mask, unsigned char val)
+{
+    unsigned char old = P1IN;
+    unsigned char changed;
+
+    P1IN = (old & ~mask) | (val & mask);
+    changed = old ^ P1IN;
+    // P1IES set selects high to low transition
+    P1IFG |= changed & ~(P1IES ^ old);
+}
+
+// Optocoupler output edge, captured if TA0.1 is waiting for it
+static bool zc_edge(bool fall)
+{
+    set_p1in(P1_ZEROCROSS, fall ? 0 : P1_ZEROCROSS);
+
+    if ((TACCTL1 & CAP) && (P1SEL & P1_ZEROCROSS) &&
+        (TACCTL1 & (fall ? CM_2 : CM_1))) {
+        TACCR1 = TAR;
+        if (TACCTL1 & CCIFG) TACCTL1 |= COV;
+        TACCTL1 |= CCIFG;
+        if (fall) zc_falls++;
+        return true;
+    }
+    return false;
+}
+
+// Output briefly reverting after a real edge, ending before the next edge
+static void bounce_schedule(void)
+{
+    double a = rand_uniform() * bounce_len, b = rand_uniform() * bounce_len;
+
+    bounce_t[0] = now + 1 + (uint64_t)fmin(a, b);
+    bounce_t[1] = now + 2 + (uint64_t)fmax(a, b);
+    if (bounce_t[1] >= opto_next) return;
+    bounce_n = 2;
+    st.bounces++;
+}
+
+static void bounce_edge(void)
+{
+    if (zc_edge((P1IN & P1_ZEROCROSS) != 0)) st.bounce_caught++;
+    bounce_n--;
+}
+
+static void opto_edge(void)
+{
+    bool real = !opto_glitch;
+
+#ifdef BURST_FIRE
+    // Real falling edge is just after the positive-going zero crossing
+    if (real && opto_fall) burst_sample();
+#endif
+    zc_edge(opto_fall);
+
+    if (!opto_fall) {
+        if (opto_glitch) opto_glitch = false;
+        else opto_cycle++;
+    }
+    opto_fall = !opto_fall;
+    opto_schedule();
+    if (real && bounce_len > 0) bounce_schedule();
+}
+
+#ifdef SERIAL_BAUD
+// Send next bit of queued commands
+static void host_send(void)
+{
+    if (host_bits == 0) {
+        if (host_qhead == host_qtail) {
+            host_next = UINT64_MAX;
+            return;
+        }
+        host_shift = (host_q[host_qtail++] << 1) | 0x200;
+        host_bits = 10;
+    }
+    host_level = host_shift & 1;
+    set_p1in(P1_SERIAL, host_level ? P1_SERIAL : 0);
+    host_shift >>= 1;
+    host_bits--;
+    host_t += ser_bitlen;
+    host_next = llround(host_t);
+}
+
+// Sample serial line, and check telemetry frames
+static void ser_decode(void)
+{
+    unsigned int i;
+    unsigned char sum = 0;
+
+    if (ser_nbit < 8) {
+        ser_byte = (ser_byte >> 1) | (ser_line ? 0x80 : 0);
+        ser_nbit++;
+        ser_sample = ser_start + llround((ser_nbit + 1.5) * ser_bitlen);
+        return;
+    }
+
+    // Stop bit
+    ser_sample = UINT64_MAX;
+    if (!ser_line) {
+        st.ser_bad++;
+        ser_flen = 0;
+        return;
+    }
+    if (serf) putc(ser_byte, serf);
+#ifdef TRACE
+    // Trace records aren't framed
+    st.ser_bytes++;
+    return;
+#endif
+    if (ser_flen == 0 && ser_byte != SER_SYNC) {
+        st.ser_bad++;
+        return;
+    }
+    ser_frame[ser_flen++] = ser_byte;
+    if (ser_flen < SER_FRAMELEN) return;
+    ser_flen = 0;
+
+    for (i = 0; i < SER_FRAMELEN - 1; i++) sum += ser_frame[i];
+    if (sum != ser_frame[SER_FRAMELEN - 1]) {
+        st.ser_bad += SER_FRAMELEN;
+        return;
+    }
+    st.ser_frames++;
+    memcpy(ser_last, ser_frame, sizeof(ser_last));
+
+    // Send queued commands after stop bit and one idle bit
+    if (host_next == UINT64_MAX && host_qhead != host_qtail) {
+        host_t = now + 1.5 * ser_bitlen;
+        host_next = llround(host_t);
+    }
+}
+#endif
+
+/*** Trace replay ***/
+
+// Read little-endian 16-bit value
+static unsigned short rp_read16(void)
+{
+    int lo = getc(replayf);
+    int hi = getc(replayf);
+
+    return (lo & 0xFF) | (hi & 0xFF) << 8;
+}
+
+// Decode residual or absolute value of record starting with c
+static unsigned short rp_value(int c, unsigned short pred, unsigned char shift)
+{
+    int r;
+
+    if ((c & TRACE_ABS) == TRACE_ABS) return rp_read16();
+    // Sign extend 12 or 5 bits
+    if (c & TRACE_MID) {
+        r = (c & 0x0F) << 8 | (getc(replayf) & 0xFF);
+        r = (r ^ 0x800) - 0x800;
+    } else {
+        r = ((c & 0x1F) ^ 0x10) - 0x10;
+    }
+    return pred + r * (1 << shift);
+}
+
+// Decode up to next timed record, queueing pot readings on the way
+static void rp_next(void)
+{
+    unsigned short ts;
+    int c, i;
+
+    while ((c = getc(replayf)) != EOF) {
+        rp.records++;
+        if ((c & 0xC0) == TRACE_ADC) {
+            rp.pot = rp_value(c, rp.pot, TRACE_POTSHIFT);
+            rp.potq[rp.pothead++ & (RP_POTQ - 1)] = rp.pot;
+            continue;
+        }
+        if ((c & 0xC0) == TRACE_IN && (c & TRACE_SYNC)) {
+            unsigned short val[5];
+
+            for (i = 0; i < 5; i++) val[i] = rp_read16();
+            rp.last[0] = val[0];
+            rp.per[0] = val[1];
+            rp.last[1] = val[2];
+            rp.per[1] = val[3];
+            rp.pot = val[4];
+            if (c & TRACE_LOST) rp.lost++;
+            continue;
+        }
+        if ((c & 0xC0) == TRACE_IN) {
+            ts = rp_read16();
+            rp.kind = RP_INPUT;
+            rp.val = c & (TRACE_WOKEN | TRACE_SW_OFF | TRACE_SW_ON |
+                          TRACE_TRIGGER);
+        } else {
+            unsigned char edge = (c & 0xC0) == TRACE_RISE;
+
+            ts = rp_value(c, rp.last[edge] + rp.per[edge], 0);
+            rp.per[edge] = ts - rp.last[edge];
+            rp.last[edge] = ts;
+            rp.kind = RP_EDGE;
+            rp.val = edge;
+        }
+        if (feof(replayf)) break;
+        // Records are less than a timer wrap apart
+        rp.tick = ticks + (unsigned short)(ts - (unsigned short)ticks);
+        return;
+    }
+    rp.kind = RP_END;
+}
+
+/* Time to apply next timed record. Captures are at their time, and inputs
+ * sampled by case 6 of TACCR1_ISR change just before. Inputs that woke the
+ * firmware from LPM4 wait for the timer to stop. */
+static uint64_t rp_time(void)
+{
+    bool woken = rp.kind == RP_INPUT && (rp.val & TRACE_WOKEN);
+    uint64_t t;
+
+    if (rp.kind == RP_END) return now;
+    if (!timer_running()) {
+        if (woken) return now;
+        // Only port 1 interrupts can restart the timer
+        rp.stuck = (P1IFG & P1IE) == 0;
+        return rp.stuck ? now : UINT64_MAX;
+    }
+    // Records are less than a timer wrap apart
+    if (ticks > rp.tick + 0x10000) {
+        rp.stuck = true;
+        return now;
+    }
+    if (woken) return UINT64_MAX;
+    t = rp.tick - (rp.kind == RP_INPUT);
+    return t > ticks ? now + (t - ticks) : now;
+}
+
+static void rp_apply(void)
+{
+    if (rp.kind == RP_EDGE) {
+        zc_edge(rp.val == 0);
+    } else {
+        unsigned char old = P1IFG;
+        unsigned char mask = P1_SW_OFF | P1_SW_ON | P1_TRIGGER;
+
+        set_p1in(mask, ((rp.val & TRACE_SW_OFF) ? P1_SW_OFF : 0) |
+                       ((rp.val & TRACE_SW_ON) ? P1_SW_ON : 0) |
+                       ((rp.val & TRACE_TRIGGER) ? P1_TRIGGER : 0));
+        // Wake even if the inputs bounced back before port 1 ISR
+        if ((rp.val & TRACE_WOKEN) && P1IFG == old) P1IFG |= P1IE & mask;
+    }
+    rp_next();
+}
+
+// Supply recorded pot reading, before case 6 of TACCR1_ISR reads it
+static void rp_pot(void)
+{
+    unsigned short val;
+
+    if (zcmode != 6 || state != STATE_ON || !POT_READY()) return;
+    if (rp.pottail == rp.pothead) {
+        rp.stuck = true;
+        return;
+    }
+    val = rp.potq[rp.pottail++ & (RP_POTQ - 1)];
+#if POT_OVERSAMPLE
+    {
+        // Samples with trimmed sum matching the reading
+        unsigned short sum = val >> (6 - POT_OVERSAMPLE);
+        unsigned short q = sum >> POT_OVERSAMPLE;
+        unsigned short k = sum & ((1 << POT_OVERSAMPLE) - 1);
+        unsigned char i;
+
+        for (i = 0; i < POT_SAMPLES - 2; i++) potbuf[i] = q + (i < k);
+        potbuf[i++] = q;
+        potbuf[i] = q + (k > 0);
+    }
+#else
+    ADC10MEM = val >> 6;
+#endif
+}
+
+// Find next event, returning its type and setting *t to its time
+#define EV_END -1
+#define EV_OPTO 0
+#define EV_INPUT 1
+#define EV_COMPARE 2
+#define EV_SERDEC 3
+#define EV_SERHOST 4
+#define EV_REPLAY 5
+#define EV_BOUNCE 6
+#define EV_VLO 7
+static int next_event(uint64_t *t)
+{
+    int ev = EV_END;
+
+    /* Compares go first when events coincide. Other events are at fixed
+     * times, but a compare would only be seen again after timer wrap. */
+    *t = end_time;
+    if (timer_running()) {
+        if (!(TACCTL0 & CAP) &&
+            ((TACCTL0 & CCIE) || (TACCTL0 & OUTMOD_7) != OUTMOD_0)) {
+            uint64_t tc = now + compare_delay(TACCR0);
+            if (tc <= *t) {
+                *t = tc;
+                ev = EV_COMPARE;
+            }
+        }
+        if ((TACCTL1 & (CAP | CCIE)) == CCIE) {
+            uint64_t tc = now + compare_delay(TACCR1);
+            if (tc <= *t) {
+                *t = tc;
+                ev = EV_COMPARE;
+            }
+        }
+    }
+    // TA0.0 capturing rising edges of ACLK
+    if ((TACCTL0 & (CAP | CCIS_1 | CM_1)) == (CAP | CCIS_1 | CM_1) &&
+        timer_running() && vlo_next < *t) {
+        *t = vlo_next;
+        ev = EV_VLO;
+    }
+    if (opto_next < *t) {
+        *t = opto_next;
+        ev = EV_OPTO;
+    }
+    if (bounce_n > 0 && bounce_t[2 - bounce_n] < *t) {
+        *t = bounce_t[2 - bounce_n];
+        ev = EV_BOUNCE;
+    }
+    if (evnext < nevents && events[evnext].t < *t) {
+        *t = events[evnext].t;
+        ev = EV_INPUT;
+    }
+    if (replayf) {
+        uint64_t tr = rp_time();
+
+        if (rp.kind == RP_END || rp.stuck) {
+            *t = now;
+            return EV_END;
+        }
+        if (tr < *t) {
+            *t = tr;
+            ev = EV_REPLAY;
+        }
+    }
+#ifdef SERIAL_BAUD
+    if (ser_sample < *t) {
+        *t = ser_sample;
+        ev = EV_SERDEC;
+    }
+    if (host_next < *t) {
+        *t = host_next;
+        ev = EV_SERHOST;
+    }
+#endif
+
+    return ev;
+}
+
+// Apply event at current time, setting interrupt flags
+static void handle_event(int ev)
+{
+    switch (ev) {
+    case EV_OPTO:
+        opto_edge();
+        break;
+    case EV_BOUNCE:
+        bounce_edge();
+        break;
+    case EV_INPUT:
+        if (events[evnext].kind == EV_POT) {
+            pot = events[evnext].val;
+            pot_t = now;
+            pot_settled = false;
+#ifdef SERIAL_BAUD
+        } else if (events[evnext].kind == EV_SERCMD) {
+            host_q[host_qhead++] = events[evnext].mask |
+                                   (events[evnext].val & SER_VALUE);
+            st.ser_cmds++;
+#endif
+        } else {
+            set_p1in(events[evnext].mask, events[evnext].val);
+            input_t = now;
+        }
+        evnext++;
+        break;
+    case EV_COMPARE:
+        // Both compares can be due at once
+        if (TACCR0 == TAR && !(TACCTL0 & CAP)) {
+            if ((TACCTL0 & OUTMOD_7) == OUTMOD_1) {
+                gate_fire(0);
+            } else if ((TACCTL0 & OUTMOD_7) == OUTMOD_5) {
+                gate_off(0);
+            }
+            TACCTL0 |= CCIFG;
+            if (!ccr0_pending) {
+                ccr0_t = now;
+                ccr0_pending = true;
+            }
+        }
+        if (TACCR1 == TAR && !(TACCTL1 & CAP)) TACCTL1 |= CCIFG;
+        break;
+#ifdef SERIAL_BAUD
+    case EV_SERDEC:
+        ser_decode();
+        break;
+    case EV_SERHOST:
+        host_send();
+        break;
+#endif
+    case EV_REPLAY:
+        rp_apply();
+        break;
+    case EV_VLO:
+        // Not a compare for reload timing
+        TACCR0 = ccr0_last = TAR;
+        TACCTL0 |= (TACCTL0 & CCIFG) ? COV : CCIFG;
+        break;
+    default:
+        longjmp(sim_exit, 1);
+    }
+}
+
+// Let time pass while the CPU is busy, without servicing interrupts
+static void sim_busy(uint64_t ticks)
+{
+    uint64_t until = now + ticks, t;
+    int ev;
+
+    while (1) {
+        ev = next_event(&t);
+        if (t > until) break;
+        advance(t);
+        handle_event(ev);
+    }
+    advance(until);
+}
+
+// Time fades, from start to when TACCR1_ISR ends them. This runs after
+// each ISR, so a fade was just started if its parameters changed, because
+// only case 6 of TACCR1_ISR starts fades, and the end of it starts the
+// first segment.
+static void fade_check(void)
+{
+#ifdef FADES
+#ifndef BURST_FIRE
+    unsigned short pos = fade_segend(fadeseg) - fadeleft;
+#endif
+
+    if (fading && (!fade_lastfading || fadefrom != fade_lastfrom ||
+                   fadetarget != fade_lasttarget ||
+                   fadelen != fade_lastlen)) {
+        fade_timing = true;
+        fade_t0 = now;
+        fade_lastfrom = fadefrom;
+        fade_lasttarget = fadetarget;
+        fade_lastlen = fadelen;
+#ifndef BURST_FIRE
+        fade_lastpos = pos - 1;
+#endif
+    }
+    fade_lastfading = fading;
+#ifndef BURST_FIRE
+    /* Power at the firing angle converted after each fade step, vs the
+     * fade's curve between its endpoints. Decreasing fades follow the
+     * curve backwards from the target. */
+    if (fading && pos != fade_lastpos && chscale[0] == 0xFFFF &&
+        triacdelay[0] != 0 && curdimpower == dimpower) {
+        double t = (double)pos / fadelen;
+        double p0 = dimpower2power(fadefrom), p1 = dimpower2power(fadetarget);
+        double want, err, power;
+
+        if (p1 >= p0) {
+            want = p0 + (p1 - p0) * fade_power(fadecurve, t);
+        } else {
+            want = p1 + (p0 - p1) * fade_power(fadecurve, 1.0 - t);
+        }
+        power = angle2power(M_PI * (1.0 - (double)triacdelay[0] / hperiod)) /
+                (M_PI / 2);
+        err = power - want;
+        fade_lastpos = pos;
+        st.fpow_n[fadecurve]++;
+        st.fpow_sq[fadecurve] += err * err;
+        if (fabs(err) > st.fpow_max[fadecurve]) {
+            st.fpow_max[fadecurve] = fabs(err);
+        }
+    }
+#endif
+    if (fade_timing && !fading) {
+        // First step is one AC cycle after fade_start()
+        double cycles = (now - fade_t0) / mains_period;
+        double want = fadelen;
+        double err = fabs(cycles - want);
+
+        fade_timing = false;
+        // Stopped by a state without a fade, rather than ended
+        if (fadeseg == FADE_NOSEG) return;
+        st.fades++;
+        if (dimpower != fadetarget) st.fade_missed++;
+        if (err > st.fade_err_max) st.fade_err_max = err;
+    }
+#endif
+}
+
+// Check hperiod and PLL phase against waveform, after case 6 of TACCR1_ISR
+static void zc_check(void)
+{
+    double tol = mains_period / 200;
+    // PLL phase is a peak, close to the one just captured
+    double peak = now - (short)(TAR - (unsigned short)(pllphase >> 16));
+    unsigned long edges = zc_falls - zc_start;
+
+    if (!zc_wait_valid || fabs(peak_err(peak)) > tol ||
+        fabs(2.0 * hperiod - mains_period) > 2 * tol) return;
+    zc_wait_valid = false;
+    st.zc_valid_sum += edges;
+    if (edges > st.zc_valid_max) st.zc_valid_max = edges;
+}
+
+// Check potavg against pot, after case 6 of TACCR1_ISR
+static void pot_check(void)
+{
+    double err = potavg / 64.0 - pot;
+
+    if (state != STATE_ON) {
+        pot_t = now;
+        pot_settled = false;
+    } else if (!pot_settled) {
+        if (fabs(err) <= 2) {
+            double settle = (now - pot_t) / tick_hz;
+
+            pot_settled = true;
+            if (settle > st.pot_settle_max) st.pot_settle_max = settle;
+        }
+    } else if (now - pot_t > tick_hz) {
+        st.pot_n++;
+        st.pot_sq += err * err;
+        if (fabs(err) > st.pot_max) st.pot_max = fabs(err);
+    }
+}
+
+/* Switch must always be able to change state. Either port 1 interrupts are
+ * enabled for it, or case 6 of TACCR1_ISR is debouncing, which needs zero
+ * crossing detection and the timer running. Checked while the main thread
+ * sleeps between interrupts. */
+static void inputs_check(void)
+{
+    unsigned short cctl1 = TACCTL1;
+
+#ifdef LPM3_IDLE
+    if (idlemode == IDLE_SLEEP) cctl1 = idlecctl1[zcmode >> 1];
+#endif
+    if (P1IE & (P1_SW_ON | P1_SW_OFF)) return;
+    if (debctr > 0 && (cctl1 & CCIE) && timer_running()) return;
+    violation(INV_DEAF, "switch ignored in state %u, with debctr %u, "
+              "TACCTL1 0x%04X, SR 0x%04X", state, debctr, cctl1, sim_sr);
+}
+
+// Once inputs are quiet for long enough to debounce, state follows switch
+static void state_check(void)
+{
+    unsigned char sw = P1IN & (P1_SW_ON | P1_SW_OFF);
+    bool ok;
+
+    if (replayf || now - input_t < (DEBOUNCE_LEN + 8) * mains_period) return;
+    if (!(sw & P1_SW_OFF)) ok = state == STATE_OFF;
+    else if (!(sw & P1_SW_ON)) ok = state == STATE_ON;
+    else ok = state == STATE_TRIGWAIT || state == STATE_TRIGGERED;
+    if (!ok) {
+        violation(INV_STATE, "state %u with switch %s after inputs quiet",
+                  state, !(sw & P1_SW_OFF) ? "off" :
+                         !(sw & P1_SW_ON) ? "on" : "auto");
+    }
+}
+
+// Interrupts can nest if firmware enables them in an ISR
+static void run_isr(void (*isr)(void), unsigned int cost)
+{
+    unsigned short outer_sr = isr_sr;
+    int mode = power_mode();
+
+    // DCO startup, when SMCLK was off
+    if (sim_sr & SCG1) sim_busy(wake_cost);
+    isr_sr = sim_sr;
+    sim_sr &= SCG0;
+    isr();
+    fade_check();
+    sim_sr = isr_sr;
+    isr_sr = outer_sr;
+    sim_sync();
+    st.isr_t[mode] += (double)act_cycles / TIMER_DIV;
+    if (mode != 2 && power_mode() == 2) st.idles++;
+    if (cost) sim_busy(cost);
+}
+
+// Run all pending interrupts, in order of priority
+static void sim_service(void)
+{
+    sim_sync();
+    while (sim_sr & GIE) {
+        if ((TACCTL0 & (CCIE | CCIFG)) == (CCIE | CCIFG)) {
+            TACCTL0 &= ~CCIFG;
+            st.isr_ccr0++;
+            run_isr(TACCR0_ISR, isr_cost);
+        } else if ((TACCTL1 & (CCIE | CCIFG)) == (CCIE | CCIFG)) {
+            TACCTL1 &= ~CCIFG;
+            st.isr_ccr1++;
+            if (replayf) rp_pot();
+            run_isr(TACCR1_ISR, zcmode == 6 ? isr_cost + work_cost : isr_cost);
+            if (zcmode == 0 && !replayf) {
+                zc_check();
+                pot_check();
+            }
+#if POT_OVERSAMPLE
+        } else if ((ADC10CTL0 & (ADC10IE | ADC10IFG)) ==
+                   (ADC10IE | ADC10IFG)) {
+            ADC10CTL0 &= ~ADC10IFG;
+            st.isr_adc10++;
+            run_isr(ADC10_ISR, isr_cost);
+#endif
+        } else if (P1IFG & P1IE) {
+            st.isr_port1++;
+            run_isr(port1_ISR, isr_cost);
+        } else {
+            break;
+        }
+    }
+}
+
+// Run simulation until firmware is woken from low power mode
+static void sim_sleep(void)
+{
+    int mode = power_mode();
+
+    while (sim_sr & CPUOFF) {
+        uint64_t t;
+        int ev = next_event(&t);
+
+        advance(t);
+        handle_event(ev);
+        sim_service();
+        inputs_check();
+    }
+    st.wakeups++;
+    st.isr_t[mode] += (double)act_cycles / TIMER_DIV;
+}
+
+/*** Flash controller ***/
+
+// Firmware's copy of information memory byte i, where flash has it
+static unsigned char *info_byte(unsigned int i)
+{
+#ifdef ENERGY_METER
+    // Segments C and B
+    if (i >= sizeof(pllsaved)) {
+        return (unsigned char *)metersaved + i - sizeof(pllsaved);
+    }
+#endif
+    return (unsigned char *)pllsaved + i;
+}
+
+// Load firmware's information memory from flash
+static void info_load(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(flash); i++) *info_byte(i) = flash[i];
+}
+
+/* Firmware stores to information memory since the last FCTL1 access are
+ * applied as the erase or write mode set then. Erasing and programming
+ * take the time of the flash timing generator, at FCTL2 divider of MCLK,
+ * which is SMCLK, so TIMER_DIV of those cycles are one tick. */
+static void flash_apply(void)
+{
+    double tick = ((FCTL2 & 0x3F) + 1.0) / TIMER_DIV;
+    unsigned int i, seg;
+    bool wrote = false;
+
+    for (i = 0; i < sizeof(flash); i++) {
+        unsigned char *mem = info_byte(i);
+
+        if (*mem == flash[i]) continue;
+        if ((FCTL3 & LOCK) || !(FCTL1 & (ERASE | WRT))) {
+            // Ignored by flash, and would have reset it with ACCVIFG
+            st.flash_bad++;
+            *mem = flash[i];
+        } else if (FCTL1 & ERASE) {
+            // Segment erase, with dummy write anywhere in segment
+            seg = i & ~63u;
+            for (i = seg; i < seg + 64 && i < sizeof(flash); i++) {
+                flash[i] = 0xFF;
+                *info_byte(i) = 0xFF;
+            }
+            st.flash_erases++;
+            sim_busy(llround(4819 * tick));
+            i--;
+        } else {
+            // Programming can only clear bits
+            if (*mem & ~flash[i]) st.flash_bad++;
+            flash[i] &= *mem;
+            *mem = flash[i];
+            wrote = true;
+            sim_busy(llround(30 * tick));
+        }
+    }
+    if (wrote) st.flash_saves++;
+}
+
+/*** Intrinsics called by firmware ***/
+
+volatile unsigned short *sim_tar(void)
+{
+    sim_sync();
+    sim_busy(1);
+    return &TAR;
+}
+
+volatile unsigned short *sim_tactl(void)
+{
+    timer_clear();
+    return &TACTL;
+}
+
+volatile unsigned short *sim_fctl1(void)
+{
+    flash_apply();
+    return &FCTL1;
+}
+
+void sim_bis_sr(unsigned short bits)
+{
+    sim_sr |= bits;
+    if (bits & GIE) sim_service();
+    sim_sleep();
+}
+
+void sim_bic_sr_on_exit(unsigned short bits)
+{
+    isr_sr &= ~bits;
+}
+
+void sim_bis_sr_on_exit(unsigned short bits)
+{
+    isr_sr |= bits;
+}
+
+unsigned short sim_get_sr_on_exit(void)
+{
+    return isr_sr;
+}
+
+void sim_enable_interrupt(void)
+{
+    sim_sr |= GIE;
+    sim_service();
+}
+
+void sim_disable_interrupt(void)
+{
+    sim_sr &= ~GIE;
+}
+
+/*** Scenario ***/
+
+static void add_event(uint64_t t, unsigned char kind, unsigned char mask,
+                      unsigned short val)
+{
+    if (nevents == evalloc) {
+        evalloc = evalloc ? evalloc * 2 : 16;
+        events = realloc(events, evalloc * sizeof(*events));
+        if (events == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    events[nevents].t = t;
+    events[nevents].kind = kind;
+    events[nevents].mask = mask;
+    events[nevents].val = val;
+    nevents++;
+}
+
+// Single input changes without bounce, which stress test repros use
+static const struct {
+    const char *name;
+    unsigned char mask, val;
+} raw_inputs[] = {
+    { "sw=off", P1_SW_OFF | P1_SW_ON, P1_SW_ON },
+    { "sw=auto", P1_SW_OFF | P1_SW_ON, P1_SW_OFF | P1_SW_ON },
+    { "sw=on", P1_SW_OFF | P1_SW_ON, P1_SW_OFF },
+    { "trig=down", P1_TRIGGER, 0 },
+    { "trig=up", P1_TRIGGER, P1_TRIGGER },
+};
+#define RAW_INPUTS (sizeof(raw_inputs) / sizeof(raw_inputs[0]))
+
+// Input change with a few milliseconds of contact bounce
+static void add_bounced(uint64_t t, unsigned char mask, unsigned char val)
+{
+    int i, n = rand_next() % 4;
+
+    add_event(t, EV_P1IN, mask, val);
+    for (i = 0; i < n; i++) {
+        t += 1 + rand_next() % (uint64_t)(tick_hz / 1000);
+        add_event(t, EV_P1IN, mask, ~val);
+        t += 1 + rand_next() % (uint64_t)(tick_hz / 1000);
+        add_event(t, EV_P1IN, mask, val);
+    }
+}
+
+static int parse_event(const char *arg)
+{
+    char *act;
+    double ts = strtod(arg, &act);
+    uint64_t t = llround(ts * tick_hz);
+    unsigned int i;
+
+    if (act == arg || *act != ':' || ts < 0) return -1;
+    act++;
+
+    for (i = 0; i < RAW_INPUTS; i++) {
+        if (!strcmp(act, raw_inputs[i].name)) {
+            add_event(t, EV_P1IN, raw_inputs[i].mask, raw_inputs[i].val);
+            return 0;
+        }
+    }
+    if (!strcmp(act, "off")) {
+        add_bounced(t, P1_SW_OFF | P1_SW_ON, P1_SW_ON);
+    } else if (!strcmp(act, "on")) {
+        add_bounced(t, P1_SW_OFF | P1_SW_ON, P1_SW_OFF);
+    } else if (!strcmp(act, "auto")) {
+        add_bounced(t, P1_SW_OFF | P1_SW_ON, P1_SW_OFF | P1_SW_ON);
+    } else if (!strcmp(act, "trig")) {
+        add_bounced(t, P1_TRIGGER, 0);
+        add_bounced(t + llround(0.2 * tick_hz), P1_TRIGGER, P1_TRIGGER);
+    } else if (!strncmp(act, "pot=", 4)) {
+        add_event(t, EV_POT, 0, atoi(act + 4) & 0x3FF);
+#ifdef SERIAL_BAUD
+    } else if (!strncmp(act, "dim=", 4)) {
+        add_event(t, EV_SERCMD, 0, strtoul(act + 4, NULL, 0));
+    } else if (!strncmp(act, "fade=", 5)) {
+        add_event(t, EV_SERCMD, SER_CMD_TIME, strtoul(act + 5, NULL, 0));
+#endif
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+    const struct simevent *ea = a, *eb = b;
+
+    if (ea->t != eb->t) return ea->t < eb->t ? -1 : 1;
+    // qsort isn't stable, so keep command line order for same time
+    return ea < eb ? -1 : 1;
+}
+
+// Run firmware from reset until end time
+static void sim_run(void)
+{
+    info_load();
+
+    // Initial input levels, including events at time zero
+    P1IN = P1_SW_OFF | P1_SW_ON | P1_TRIGGER | P1_ZEROCROSS | P1_SERIAL;
+    while (evnext < nevents && events[evnext].t == 0) {
+        if (events[evnext].kind == EV_POT) {
+            pot = events[evnext].val;
+        } else {
+            P1IN = (P1IN & ~events[evnext].mask) |
+                   (events[evnext].val & events[evnext].mask);
+        }
+        evnext++;
+    }
+
+    mains_period = tick_hz / mains_hz;
+#ifdef SERIAL_BAUD
+    ser_bitlen = tick_hz / SERIAL_BAUD;
+#endif
+    mains_phase = mains_period * (1.0 + rand_uniform());
+    opto_ofs = asin(opto_thresh) / (2 * M_PI) * mains_period;
+    opto_fall = true;
+    opto_schedule();
+    end_time = llround(duration * tick_hz);
+    if (replayf) {
+        opto_next = UINT64_MAX;
+        end_time = UINT64_MAX;
+        rp_next();
+    }
+
+    if (!setjmp(sim_exit)) mspac_main();
+}
+
+/*** Stress test ***/
+/* Each case starts from reset with random switch and trigger changes. Most
+ * are contact bounce, down to a microsecond apart, and some are long enough
+ * to debounce. A case runs in a forked child, so firmware and simulator
+ * state start fresh, and ends at the first invariant violated. A failing
+ * case is shrunk by removing events and cutting it short after the
+ * failure, for as long as the same invariant still fails. */
+
+#define STRESS_MAX 32              // Input changes per case, at most
+#define STRESS_ARG 24              // Length of event argument
+#define STRESS_QUIET 0.5           // Seconds after last change, for
+                                   // debouncing and fades
+
+struct stress_case {
+    uint64_t seed;                 // Seed for optocoupler phase and noise
+    double duration;
+    int n;
+    char ev[STRESS_MAX + 2][STRESS_ARG]; // Events, as for option -e
+};
+
+static void stress_gen(struct stress_case *c)
+{
+    int k = 1 + rand_next() % STRESS_MAX, pos = rand_next() % 3;
+    bool down = rand_next() % 8 == 0;
+    double t = 0;
+
+    c->seed = rand_next() | 1;
+    c->n = 0;
+    // Switch position, then trigger, from raw_inputs
+    snprintf(c->ev[c->n++], STRESS_ARG, "0:%s", raw_inputs[pos].name);
+    snprintf(c->ev[c->n++], STRESS_ARG, "0:%s",
+             raw_inputs[down ? 3 : 4].name);
+    while (k-- > 0) {
+        if (rand_next() % 4) t += (1 + rand_next() % 5000) * 1e-6;
+        else t += (10 + rand_next() % 400) * 1e-3;
+        if (rand_next() % 4) {
+            pos = rand_next() % 3;
+            snprintf(c->ev[c->n++], STRESS_ARG, "%.6f:%s", t,
+                     raw_inputs[pos].name);
+        } else {
+            down = !down;
+            snprintf(c->ev[c->n++], STRESS_ARG, "%.6f:%s", t,
+                     raw_inputs[down ? 3 : 4].name);
+        }
+    }
+    c->duration = ceil((t + STRESS_QUIET) * 1000) / 1000;
+}
+
+// Run case in a child, returning the invariant violated, or 0 if none
+static int stress_try(const struct stress_case *c, struct violation *v)
+{
+    pid_t pid;
+    int status, i;
+
+    memset(stress_res, 0, sizeof(*stress_res));
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        seed = c->seed;
+        duration = c->duration;
+        for (i = 0; i < c->n; i++) parse_event(c->ev[i]);
+        qsort(events, nevents, sizeof(*events), event_cmp);
+        sim_run();
+        inputs_check();
+        state_check();
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(1);
+    }
+    *v = *stress_res;
+    if (v->inv == 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        v->inv = INV_CRASH;
+        v->t = c->duration;
+        if (WIFSIGNALED(status)) {
+            snprintf(v->msg, sizeof(v->msg), "killed by signal %d",
+                     WTERMSIG(status));
+        } else {
+            snprintf(v->msg, sizeof(v->msg), "exit status %d",
+                     WEXITSTATUS(status));
+        }
+    }
+    return v->inv;
+}
+
+// End case a millisecond or two after failure, if it still fails the same
+static unsigned long stress_cut(struct stress_case *c, struct violation *fail)
+{
+    struct stress_case t = *c;
+    struct violation v;
+
+    // State is only checked at the end
+    if (fail->inv == INV_STATE || fail->inv == INV_CRASH) return 0;
+    t.duration = ceil(fail->t * 1000 + 1) / 1000;
+    if (t.duration >= c->duration) return 0;
+    if (stress_try(&t, &v) == fail->inv) {
+        *c = t;
+        *fail = v;
+    }
+    return 1;
+}
+
+// Remove chunks of events, halving chunk size down to single events
+static unsigned long stress_shrink(struct stress_case *c,
+                                   struct violation *fail)
+{
+    struct stress_case t;
+    struct violation v;
+    unsigned long runs = stress_cut(c, fail);
+    int chunk = c->n / 2, i, len;
+    bool removed;
+
+    if (chunk < 1) chunk = 1;
+    while (1) {
+        removed = false;
+        for (i = 0; i < c->n; ) {
+            len = chunk < c->n - i ? chunk : c->n - i;
+            t = *c;
+            memmove(t.ev[i], t.ev[i + len], (t.n - i - len) * STRESS_ARG);
+            t.n -= len;
+            runs++;
+            if (stress_try(&t, &v) == fail->inv) {
+                *c = t;
+                *fail = v;
+                removed = true;
+            } else {
+                i += len;
+            }
+        }
+        if (chunk > 1) chunk /= 2;
+        else if (!removed) break;
+    }
+    return runs + stress_cut(c, fail);
+}
+
+static int stress_run(unsigned long cases, int argc, char **argv)
+{
+    struct stress_case c;
+    struct violation v;
+    struct timespec t0, t1;
+    unsigned long i, runs;
+    double secs;
+    int n, a;
+
+    stress_res = mmap(NULL, sizeof(*stress_res), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stress_res == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(flash, 0xFF, sizeof(flash));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < cases; i++) {
+        stress_gen(&c);
+        if (stress_try(&c, &v) == 0) continue;
+
+        printf("Stress case %lu failed at %.6f s: %s\n", i + 1, v.t, v.msg);
+        n = c.n;
+        runs = stress_shrink(&c, &v);
+        printf("Shrunk from %d to %d events in %lu runs, failing at %.6f s: "
+               "%s\n", n, c.n, runs, v.t, v.msg);
+
+        // Repro, with the other options as given
+        printf("%s", argv[0]);
+        for (a = 1; a < argc; a++) {
+            if (argv[a][0] == '-' && argv[a][1] != '\0' &&
+                strchr("Ssd", argv[a][1])) {
+                if (argv[a][2] == '\0') a++;
+                continue;
+            }
+            printf(" %s", argv[a]);
+        }
+        printf(" -s 0x%llx -d %.3f", (unsigned long long)c.seed,
+               c.duration);
+        for (a = 0; a < c.n; a++) printf(" -e %s", c.ev[a]);
+        printf("\n");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    printf("Stress: %lu cases in %.1f s (%.0f per second), no invariant "
+           "violated\n", cases, secs, secs > 0 ? cases / secs : 0);
+    return 0;
+}
+
+/*** Main ***/
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d seconds] [-f mains_hz] [-c smclk_hz] "
+                    "[-j jitter_ticks]\n"
+                    "       [-m miss_prob] [-g glitch_prob] [-b bounce_ticks] "
+                    "[-i isr_ticks]\n"
+                    "       [-w work_ticks] [-p pot_code] [-a adc_noise] "
+                    "[-s seed] [-t trace.csv]\n"
+                    "       [-x serial.bin] [-r replay.bin] "
+                    "[-D delays.txt] [-F flash.bin]\n"
+                    "       [-v vlo_hz] [-L wake_ticks] [-A cycles] "
+                    "[-G gate_ma] [-S cases]\n"
+                    "       [-e time:off|auto|on|trig|pot=N|sw=off|auto|on|"
+                    "trig=down|up"
+#ifdef SERIAL_BAUD
+                    "|dim=N|fade=N"
+#endif
+                    "]...\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    const char *tracename = NULL, *sername = NULL, *replayname = NULL;
+    const char *delayname = NULL;
+    char **evargs = calloc(argc, sizeof(char *));
+    int nevargs = 0, i;
+    clock_t wall;
+    double secs;
+    unsigned long stress_cases = 0;
+
+    while ((opt = getopt(argc, argv,
+                         "d:f:c:j:m:g:b:i:w:p:a:s:t:x:r:D:F:v:L:A:G:e:S:")) !=
+           -1) {
+        switch (opt) {
+        case 'd': duration = atof(optarg); break;
+        case 'f': mains_hz = atof(optarg); break;
+        case 'c': clk_hz = atof(optarg); break;
+        case 'j': edge_jitter = atof(optarg); break;
+        case 'm': miss_prob = atof(optarg); break;
+        case 'g': glitch_prob = atof(optarg); break;
+        case 'b': bounce_len = atof(optarg); break;
+        case 'i': isr_cost = atoi(optarg); break;
+        case 'w': work_cost = atoi(optarg); break;
+        case 'p': pot = atoi(optarg) & 0x3FF; break;
+        case 'a': adc_noise = atof(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0) | 1; break;
+        case 't': tracename = optarg; break;
+        case 'x': sername = optarg; break;
+        case 'r': replayname = optarg; break;
+        case 'D': delayname = optarg; break;
+        case 'F': flashname = optarg; break;
+        case 'v': vlo_hz = atof(optarg); break;
+        case 'L': wake_cost = atoi(optarg); break;
+        case 'A': act_cycles = atoi(optarg); break;
+        case 'G': gate_ma = atof(optarg); break;
+        case 'e': evargs[nevargs++] = optarg; break;
+        case 'S': stress_cases = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || duration <= 0 || mains_hz <= 0 || clk_hz <= 0 ||
+        miss_prob < 0 || miss_prob >= 1 || glitch_prob < 0 ||
+        glitch_prob > 1 || bounce_len < 0 || vlo_hz <= 0 || gate_ma < 0) {
+        usage(argv[0]);
+    }
+#ifdef LPM3_IDLE
+    // Trace timestamps assume TAR counts SMCLK all the time
+    if (replayname != NULL) {
+        fprintf(stderr, "Replay is not supported with LPM3_IDLE\n");
+        return 1;
+    }
+#endif
+
+    // Firmware divides SMCLK for the timer, and simulated time is in ticks
+    tick_hz = clk_hz / TIMER_DIV;
+    vlo_per = tick_hz / vlo_hz;
+    vlo_next = vlo_edge(0);
+
+    // Stress test cases have their own inputs, and print no statistics
+    if (stress_cases) {
+        if (nevargs || tracename || sername || replayname || delayname ||
+            flashname) {
+            fprintf(stderr, "Option -S can't be used with -e, -t, -x, -r, "
+                            "-D or -F\n");
+            return 1;
+        }
+        return stress_run(stress_cases, argc, argv);
+    }
+
+    // Events are parsed after options so they use the final clock rate
+    if (nevargs == 0 && replayname == NULL) parse_event("0:on");
+    for (i = 0; i < nevargs; i++) {
+        if (parse_event(evargs[i]) < 0) {
+            fprintf(stderr, "Bad event: %s\n", evargs[i]);
+            usage(argv[0]);
+        }
+    }
+    free(evargs);
+    qsort(events, nevents, sizeof(*events), event_cmp);
+
+    if (tracename != NULL) {
+        tracef = fopen(tracename, "w");
+        if (tracef == NULL) {
+            perror(tracename);
+            return 1;
+        }
+        fprintf(tracef, "time,state,dimpower,triacdelay,hperiod,"
+                        "delay,error,channel\n");
+    }
+    if (sername != NULL) {
+        serf = fopen(sername, "wb");
+        if (serf == NULL) {
+            perror(sername);
+            return 1;
+        }
+    }
+    if (delayname != NULL) {
+        delayf = fopen(delayname, "w");
+        if (delayf == NULL) {
+            perror(delayname);
+            return 1;
+        }
+    }
+    if (replayname != NULL) {
+        replayf = fopen(replayname, "rb");
+        if (replayf == NULL) {
+            perror(replayname);
+            return 1;
+        }
+        // Trace replaces synthetic inputs
+        nevents = 0;
+    }
+
+    // Information memory is erased unless image exists
+    memset(flash, 0xFF, sizeof(flash));
+    if (flashname != NULL) {
+        FILE *f = fopen(flashname, "rb");
+
+        if (f != NULL) {
+            if (fread(flash, 1, sizeof(flash), f) != sizeof(flash)) {
+                fprintf(stderr, "%s: short image\n", flashname);
+                return 1;
+            }
+            fclose(f);
+        }
+    }
+    wall = clock();
+    sim_run();
+    wall = clock() - wall;
+    inputs_check();
+    state_check();
+
+    if (tracef) fclose(tracef);
+    if (serf) fclose(serf);
+    if (delayf) fclose(delayf);
+    if (flashname != NULL) {
+        FILE *f = fopen(flashname, "wb");
+
+        if (f == NULL || fwrite(flash, 1, sizeof(flash), f) != sizeof(flash)) {
+            perror(flashname);
+            return 1;
+        }
+        fclose(f);
+    }
+    if (replayf) {
+        duration = now / tick_hz;
+        printf("Replay: %lu records, %lu sync records after lost ones, "
+               "%s\n", rp.records, rp.lost,
+               rp.stuck ? "firmware diverged from trace" : "trace ended");
+        fclose(replayf);
+    }
+
+    secs = (double)wall / CLOCKS_PER_SEC;
+    printf("Simulated %.1f s (%.0f AC cycles) in %.3f s, %.0fx real time\n",
+           duration, duration * mains_hz, secs,
+           secs > 0 ? duration / secs : 0);
+    printf("Interrupts: TACCR0 %lu, TACCR1 %lu, port 1 %lu, ADC10 %lu\n",
+           st.isr_ccr0, st.isr_ccr1, st.isr_port1, st.isr_adc10);
+    printf("Main loop wakeups: %lu (%.2f per AC cycle)\n",
+           st.wakeups, st.wakeups / (duration * mains_hz));
+    if (st.missed || st.glitches) {
+        printf("Optocoupler pulses: %lu missing, %lu spurious\n",
+               st.missed, st.glitches);
+    }
+    if (st.bounces) {
+        printf("Optocoupler edge bounces: %lu, %lu bounce edges captured\n",
+               st.bounces, st.bounce_caught);
+    }
+    printf("TRIAC firings: %lu, %lu before PLL lock",
+           st.firings, st.unlocked);
+    if (CHANNELS > 1) {
+        printf(", by channel:");
+        for (i = 0; i < CHANNELS; i++) printf(" %lu", st.chfirings[i]);
+    }
+    printf("\n");
+    if (st.reloads) {
+        printf("TACCR0 reload after compare: mean %.1f, max %llu ticks\n",
+               (double)st.reload_sum / st.reloads,
+               (unsigned long long)st.reload_max);
+    }
+    if (st.pulses) {
+        printf("Gate pulse: mean %.1f, min %llu, max %llu ticks\n",
+               (double)st.pulse_sum / st.pulses,
+               (unsigned long long)st.pulse_min,
+               (unsigned long long)st.pulse_max);
+    }
+    printf("mult() calls: %lu (%.2f per AC cycle)\n", mult_calls,
+           mult_calls / (duration * mains_hz));
+#ifdef WORK_STATS
+    if (workstats.overruns || workstats.deferrals) {
+        printf("Case 6 work: %u overruns, %u tasks deferred\n",
+               workstats.overruns, workstats.deferrals);
+    }
+#endif
+#ifdef UPDATE_STATS
+    /* Without tolerances, each skipped pot reading would have been a
+     * conversion, and without caching, each reused triacdelay would have
+     * been converted again. */
+    printf("Conversions: %u pot readings skipped, %u for hperiod change, "
+           "%u reused triacdelay\n",
+           updstats.wakeskip, updstats.hwake, updstats.convskip);
+    printf("Saved per minute: %.1f conversions\n",
+           (updstats.wakeskip + updstats.convskip) * 60 / duration);
+#endif
+    if (st.firings && !replayf) {
+        double mean = st.err_sum / st.firings;
+        printf("Firing time vs triacdelay: mean %.2f, RMS %.2f, "
+               "max %.2f ticks\n",
+               mean, sqrt(st.err_sq / st.firings), st.err_max);
+    }
+    if (st.perr_n) {
+        printf("Steady power vs analytic curve: RMS %.5f, max %.5f\n",
+               sqrt(st.perr_sq / st.perr_n), st.perr_max);
+    }
+    for (i = 0; i < FADE_NONE; i++) {
+        static const char *const name[FADE_NONE] = {
+            "linear", "perceptual", "S-curve"
+        };
+
+        if (st.fpow_n[i] == 0) continue;
+        printf("Fade power vs %s curve: %lu steps, RMS %.5f, max %.5f\n",
+               name[i], st.fpow_n[i], sqrt(st.fpow_sq[i] / st.fpow_n[i]),
+               st.fpow_max[i]);
+    }
+#ifdef BURST_FIRE
+    if (st.burst_n) {
+        printf("Burst fire: %lu steady AC cycles, conducting",
+               st.burst_n);
+        for (i = 0; i < CHANNELS; i++) {
+            printf(" %lu (want %.1f)", st.burst_on[i], st.burst_want[i]);
+        }
+        printf("\n");
+    }
+    if (!replayf) {
+        long dc = 0;
+
+        // Bursts still going at the end are cut short, so not counted
+        for (i = 0; i < CHANNELS; i++) {
+            if (gates & (1 << i)) burst_halves(i);
+        }
+        for (i = 0; i < CHANNELS; i++) {
+            if (labs(st.burst_dc[i]) > dc) dc = labs(st.burst_dc[i]);
+        }
+        printf("Burst fire: %lu bursts not whole cycles, max %ld unpaired "
+               "half-cycles\n", st.burst_odd, dc);
+    }
+#endif
+    if (st.pot_n) {
+        printf("Pot: potavg within 2 codes after %.3f s max, then error "
+               "RMS %.3f, max %.3f codes\n", st.pot_settle_max,
+               sqrt(st.pot_sq / st.pot_n), st.pot_max);
+    }
+    if (st.zc_starts && !replayf) {
+        printf("Zero crossing starts: %lu, valid after mean %.2f, max %lu "
+               "edges, firing after mean %.2f, max %lu edges\n",
+               st.zc_starts, (double)st.zc_valid_sum / st.zc_starts,
+               st.zc_valid_max, (double)st.zc_fire_sum / st.zc_starts,
+               st.zc_fire_max);
+    }
+    if (st.flash_saves || st.flash_erases || st.flash_bad) {
+        printf("Information memory: %lu saves, %lu segment erases, %lu bad "
+               "writes\n", st.flash_saves, st.flash_erases, st.flash_bad);
+    }
+#ifdef ENERGY_METER
+    {
+        unsigned long lit = meter.lit[0] | (unsigned long)meter.lit[1] << 16;
+        double energy = meter.energy[0] +
+                        (unsigned long)meter.energy[1] * 65536.0 +
+                        meter.energyfrac / 65536.0;
+        static const char *const names[] = {
+            "triggered", "on"
+        };
+
+        printf("Energy meter: %.2f half-cycles at full power, %lu lit "
+               "(mean power %.4f)\n", energy, lit, lit ? energy / lit : 0.0);
+        printf("Energy delivered: %.2f half-cycles at full power in this "
+               "run\n", st.energy);
+        printf("AC cycles lit in state:");
+        for (i = 0; i < 2; i++) {
+            printf(" %s %lu", names[i], meter.dwell[i][0] |
+                   (unsigned long)meter.dwell[i][1] << 16);
+        }
+        printf("\n");
+    }
+#endif
+    if (st.fades) {
+        printf("Fades: %lu, %lu not ending at target, length error max "
+               "%.2f AC cycles\n", st.fades, st.fade_missed,
+               st.fade_err_max);
+    }
+    if (violations) {
+        printf("Invariant violations: %lu, first at %.6f s: %s\n",
+               violations, viol_first.t, viol_first.msg);
+    }
+#ifdef SERIAL_BAUD
+#ifdef TRACE
+    printf("Serial: %lu trace bytes (%.2f per AC cycle), %lu bad bytes\n",
+           st.ser_bytes, st.ser_bytes / (duration * mains_hz), st.ser_bad);
+#else
+    printf("Serial: %lu frames (%.2f per AC cycle), %lu bad bytes, "
+           "%lu commands sent\n", st.ser_frames,
+           st.ser_frames / (duration * mains_hz), st.ser_bad, st.ser_cmds);
+#endif
+    printf("Serial bit edges vs %u baud: max error %.1f ticks "
+           "(%.0f%% of bit)\n", SERIAL_BAUD, st.ser_edge_max,
+           100 * st.ser_edge_max / ser_bitlen);
+    if (st.ser_frames) {
+        printf("Last frame: state %u, hperiod %u, dimpower %u, potavg %u, "
+               "triacdelay %u\n", ser_last[1],
+               ser_last[2] | ser_last[3] << 8, ser_last[4] | ser_last[5] << 8,
+               ser_last[6] | ser_last[7] << 8, ser_last[8] | ser_last[9] << 8);
+    }
+#endif
+    {
+        /* Roughly the datasheet typicals at 3 V, with active mode and LPM0
+         * proportional to SMCLK. Interrupts and wakeups are assumed to run
+         * for act_cycles, instead of time spent in the mode they came from.
+         * The VLO is included in LPM3. */
+        static const char *const name[4] = { "active", "LPM0", "LPM3",
+                                             "LPM4" };
+        double ua[4] = { 300 * clk_hz / 1e6, 70 * clk_hz / 1e6, 0.6, 0.1 };
+        double total = now, t[4], sum = 0, part[6];
+
+        t[0] = st.mode_t[0];
+        for (i = 0; i < 4; i++) t[0] += st.isr_t[i];
+        for (i = 1; i < 4; i++) {
+            t[i] = st.mode_t[i] - st.isr_t[i];
+            if (t[i] < 0) t[i] = 0;
+        }
+        printf("Time in");
+        for (i = 0; i < 4; i++) {
+            part[i] = ua[i] * t[i] / total;
+            printf("%s %s %.3f%%", i ? "," : "", name[i], 100 * t[i] / total);
+        }
+        printf("\n");
+        part[4] = 600 * st.adc_t / total;
+        part[5] = 1000 * gate_ma * st.gate_t / total;
+        for (i = 0; i < 6; i++) sum += part[i];
+        printf("Supply current: mean %.1f uA, from", sum);
+        for (i = 0; i < 4; i++) printf(" %s %.1f,", name[i], part[i]);
+        printf(" ADC10 %.1f, gates %.1f uA\n", part[4], part[5]);
+        if (st.idles) {
+            printf("LPM3 idles: %lu (%.2f per AC cycle), mean %.0f ticks\n",
+                   st.idles, st.idles / (duration * mains_hz),
+                   st.mode_t[2] / (double)st.idles);
+        }
+    }
+#ifdef ISR_PROFILE
+    printf("TACCR0 latency histogram (%u ticks per bin), max %u ticks:\n",
+           1 << PROF_BINSHIFT, isrprof.latmax);
+    for (i = 0; i < PROF_BINS; i++) {
+        if (isrprof.lathist[i]) {
+            // Counts saturate at 255
+            printf("  %5u: %u%s\n", i << PROF_BINSHIFT, isrprof.lathist[i],
+                   isrprof.lathist[i] == 0xFF ? "+" : "");
+        }
+    }
+    printf("Longest ISR run time:");
+    for (i = 0; i < PROF_NUM; i++) printf(" %u", isrprof.costmax[i]);
+    printf("\n");
+#endif
+    printf("Final: state %u, dimpower %u, triacdelay %u, hperiod %u, "
+           "PLL %s\n", state, dimpower, triacdelay[0], hperiod,
+           plllock >= PLL_LOCKED ? "locked" : "unlocked");
+
+    return 0;
+}
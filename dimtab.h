@@ -0,0 +1,105 @@
+/* Dimming table, translating desired output power to trigger angle.
+ * Generated by: Tools/dimtab -o dimtab.h
+ * The high order DIMTAB_REGION_BITS of the 16 bit dimming value select a
+ * region, which has its own number of table slots. Other bits select a
+ * slot and linearly interpolate within it. The last value would correspond
+ * to 0x10000, so it is only approached using interpolation from 0xFFFF.
+ */
+
+/* 8 regions, 66 bytes, max power error 0.005120
+ * 0x0000-0x1FFF:   1 entries, max error 0.000770
+ * 0x2000-0x3FFF:   1 entries, max error 0.000471
+ * 0x4000-0x5FFF:   1 entries, max error 0.000074
+ * 0x6000-0x7FFF:   1 entries, max error 0.000599
+ * 0x8000-0x9FFF:   1 entries, max error 0.001608
+ * 0xA000-0xBFFF:   1 entries, max error 0.003510
+ * 0xC000-0xDFFF:   2 entries, max error 0.002583
+ * 0xE000-0xFFFF:  16 entries, max error 0.005120
+ */
+
+#define DIMTAB_REGION_BITS 3
+// Square root of power at dimming value 0
+#define DIMTAB_P0 0.124568
+// Largest half-period for which dimdelay() was checked
+#define DIMTAB_MAX_HPERIOD 65535
+
+// Right shift of dimming value bits within region, giving slot
+static const unsigned char dimtab_shift[8] = { 13, 13, 13, 13, 13, 13, 12, 9 };
+// Index of first slot of region
+static const unsigned char dimtab_first[8] = { 0, 1, 2, 3, 4, 5, 6, 8 };
+
+// Trigger delay at start of slot, with 0xFFFF == 1.0
+static const unsigned short dimtab[25] = {
+    56707, /* 0.124568: 24.247316 */
+    51868, /* 0.233997: 37.537158 */
+    47505, /* 0.343426: 49.521302 */
+    43276, /* 0.452855: 61.136276 */
+    38971, /* 0.562284: 72.961223 */
+    34370, /* 0.671713: 85.599208 */
+    29120, /* 0.781142: 100.017918 */
+    26028, /* 0.835857: 108.509655 */
+    22336, /* 0.890571: 118.652272 */
+    21808, /* 0.897410: 120.101670 */
+    21260, /* 0.904250: 121.606499 */
+    20690, /* 0.911089: 123.173651 */
+    20093, /* 0.917928: 124.811464 */
+    19467, /* 0.924768: 126.530185 */
+    18808, /* 0.931607: 128.342623 */
+    18108, /* 0.938446: 130.265130 */
+    17360, /* 0.945286: 132.319101 */
+    16554, /* 0.952125: 134.533406 */
+    15674, /* 0.958964: 136.948536 */
+    14700, /* 0.965803: 139.624246 */
+    13597, /* 0.972643: 142.654851 */
+    12304, /* 0.979482: 146.204891 */
+    10700, /* 0.986321: 150.610357 */
+    8446, /* 0.993161: 156.800875 */
+    117, /* 1.000000: 179.678946 */
+};
+
+/* Slot dimdelay() last scaled, with its base and slope scaled by the h it
+ * was scaled for. Set dimtab_cslot to DIMTAB_NOSLOT when h changes, which
+ * saves keeping h.
+ */
+#define DIMTAB_NOSLOT 0xFF
+static unsigned char dimtab_cslot = DIMTAB_NOSLOT;
+static unsigned short dimtab_hbase, dimtab_hslope;
+
+/* Convert dimming value to trigger delay in timer cycles, for half-period
+ * h. The slot endpoints are scaled by h before interpolating, which keeps
+ * the result monotonic across slots. While the slot is unchanged, that
+ * is kept, and conversion takes one mult(). Tools/dimtab checked that it
+ * is within 1 of mult(interpolated delay, h) for h up to
+ * DIMTAB_MAX_HPERIOD.
+ */
+static unsigned short dimdelay(unsigned short dim, unsigned short h)
+{
+    unsigned char region = dim >> (16 - DIMTAB_REGION_BITS);
+    unsigned char shift = dimtab_shift[region];
+    unsigned char slot = dimtab_first[region] +
+        ((dim & (0xFFFF >> DIMTAB_REGION_BITS)) >> shift);
+
+    if (slot != dimtab_cslot) {
+        dimtab_hbase = mult(dimtab[slot], h);
+        dimtab_hslope = dimtab_hbase - mult(dimtab[slot + 1], h);
+        dimtab_cslot = slot;
+    }
+
+    // Linearly interpolate between scaled endpoints using remaining bits
+    return dimtab_hbase - mult(dimtab_hslope, dim << (16 - shift));
+}
+
+// Fade curves of main.c, as dimming value at segment ends of a fade over
+// the whole range, so power follows the curve
+#define DIMTAB_FADE_SEG_BITS 4
+static const unsigned short dimtab_fade[3][17] = {
+    // power linear in t
+    { 0, 11454, 18542, 24162, 28966, 33231, 37106, 40682, 44018, 47158, 50132,
+      52964, 55673, 58274, 60778, 63195, 65535 },
+    // CIE lightness 100*t
+    { 0, 1861, 3666, 6014, 8856, 12118, 15739, 19673, 23888, 28358, 33063,
+      37988, 43120, 48449, 53966, 59664, 65535 },
+    // power 3*t^2 - 2*t^3
+    { 0, 2878, 8675, 15090, 21481, 27642, 33484, 38955, 44018, 48641, 52791,
+      56435, 59537, 62053, 63935, 65120, 65535 }
+};
@@ -1,18 +1,146 @@
 /* MSPAC - AC phase control via MSP430, by Boris Gjenero */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "io430.h"
 
 /*** Configuration constants ***/
 
-// Speed for on-off dimming
-#define DIMSPEED 200
-// Speed for triggered slow brightness increase
-#define TRIGDIMSPEED 1
+// Fade time when switching on or off, in seconds
+#define FADE_ONOFF_TIME 3
+// Fade time for triggered slow brightness increase, in seconds
+#define FADE_TRIG_TIME (18 * 60)
+// Leaving out both fade times leaves out fading, and dimming changes at
+// once, also for serial commands.
 // Target for triggered slow brightness increase
 #define TRIGDIMTARGET 0xFFFF
-// Button and trigger debounce length, in terms of 1/60s
-#define DEBOUNCE_LEN 5
+// Fade curves, from FADE_LINEAR, FADE_PERCEPTUAL and FADE_SCURVE
+#define FADE_ONOFF_CURVE FADE_SCURVE
+#define FADE_TRIG_CURVE FADE_PERCEPTUAL
+// Button and trigger debounce time, in ms
+#define DEBOUNCE_MS 83
+// Averaged pot change needed before triacdelay is converted to follow it.
+// One ADC10 step is 64.
+#define POT_TOLERANCE 64
+// Added to averaged pot value, saturating, so 0xFFFF can be reached
+#define POT_OFFSET 1500
+// Pot oversampling, as log2 of samples averaged per AC cycle, from 1 to 6.
+// The ADC10 data transfer controller collects two more, and the highest and
+// lowest are discarded. With 0, a single sample is read per AC cycle.
+// Samples are kept in potbuf, taking 2 * ((1 << n) + 2) bytes of RAM: 8 at
+// 1, 12 at 2 and 20 at 3, and none at 0. That buys resolution and noise
+// rejection. With the ADC noise of Tools/sim -a 2, the RMS error of potavg
+// is 0.54 ADC10 codes at 0, 0.41 at 1, 0.33 at 2 and 0.25 at 3, and at 0,
+// an outlier isn't discarded and potavg takes twice as long to settle.
+// Some options fit the MSP430G2231 only with 0.
+#ifndef POT_OVERSAMPLE
+#define POT_OVERSAMPLE 1
+#endif
+// MCLK and SMCLK frequency from calibrated DCO, in MHz: 1, 8 or 16. Timer_A
+// is divided to at most 2 MHz, so an AC period fits in 16 bits. 8 and 16 MHz
+// need a device with CALBC1_8MHZ or CALBC1_16MHZ in segment A, unlike the
+// MSP430G2231, and 16 MHz needs VCC of at least 3.3 V.
+#ifndef SMCLK_MHZ
+#define SMCLK_MHZ 1
+#endif
+// Mains frequency, 50 or 60 Hz, or 0 for detecting either at run time
+#ifndef MAINS_HZ
+#define MAINS_HZ 0
+#endif
+// Dimming table generated by Tools/dimtab. Its -b or -e option sets table
+// resolution, and its -h must cover the largest half-period.
+#ifndef DIMTAB_H
+#define DIMTAB_H "dimtab.h"
+#endif
+// Follow the pot through a composite table generated by Tools/dimtab -a,
+// with POT_OFFSET and saturation folded in, instead of through dimtab.
+// Generate it with the same -p, -b and -e as DIMTAB_H.
+//#define POT_DIRECT
+#ifndef POTTAB_H
+#define POTTAB_H "pottab.h"
+#endif
+// Shortest TRIAC gate pulse, in microseconds. Pulses end at a TA0.0
+// compare, by hardware for channel 0, so others get longer ones from
+// TACCR0_ISR latency.
+#define GATE_PULSE_US 10
+// TRIAC gate hold when firing early in the half-cycle, as 1/2^n of
+// half-period. It is also how early firing must be for the hold.
+#define GATE_HOLD_SHIFT 3
+// Zero crossing detector blanking after optocoupler edges, as 1/2^n of
+// half-period. Bounce after the falling edge is ignored, and blanking after
+// the rising edge must end in the next half cycle.
+#define ZC_FALL_SHIFT 3
+#define ZC_RISE_SHIFT 1
+// Periodic work after the rising edge must end this far before the next
+// falling edge, as 1/2^n of half-period. Pot reading and input debouncing
+// are deferred to the next AC cycle when they might not fit.
+#define WORK_MARGIN_SHIFT 3
+// Half-period change needed before triacdelay is recalculated, in timer
+// cycles. Up to 4 cycles off changes power by under 0.1% at 60 Hz.
+#define HPERIOD_TOLERANCE 4
+// Zero crossing PLL gains, as right shifts of phase error applied to phase
+// and period. Fast gains are used until lock, for quick acquisition.
+#define PLL_KP 3
+#define PLL_KI 7
+#define PLL_KP_FAST 1
+#define PLL_KI_FAST 3
+// Good cycles until PLL is locked, and bad cycles until lock is lost
+#define PLL_LOCKED 8
+#define PLL_MAXBAD 4
+// Phase error accepted as 1/2^n of period, when locked and when not locked
+#define PLL_WINDOW_SHIFT 5
+#define PLL_WINDOW_SHIFT_FAST 3
+// Longest run of cycles without optocoupler pulses that PLL coasts over
+#define PLL_MAXCOAST 3
+// Locked period change before the period saved in information memory is
+// rewritten, in timer cycles
+#define PLLSAVE_TOLERANCE 16
+// Number of TRIAC channels, from 1 to 3, sharing the zero crossing detector
+#ifndef CHANNELS
+#define CHANNELS 1
+#endif
+// Dimming value scale for each channel, with 0xFFFF == 1.0
+#define CHANNEL_SCALE { 0xFFFF, 0xC000, 0x8000 }
+// Integral cycle (burst fire) control for resistive loads like heaters,
+// instead of phase control. Whole AC cycles are switched on at zero
+// crossings, and dimpower is the fraction of cycles that are on. The gate
+// is held from the start of a burst to its end, which takes one timer
+// event per burst. Gate current thus flows through whole bursts, instead of
+// in short holds as in phase control.
+//#define BURST_FIRE
+// Tickless idle while lit. When the next timer event is far enough ahead,
+// Timer_A counts VLO periods via ACLK in LPM3, instead of SMCLK in LPM0.
+// Its 13 bytes and 20 more of stack fit in the MSP430G2231 with
+// POT_OVERSAMPLE 0 and without fade times, as checked by Tools/ramcheck.sh.
+//#define LPM3_IDLE
+// Half-duplex serial telemetry and commands on P1.2, at this baud rate.
+// Its 14 bytes and 12 more of stack fit in the MSP430G2231 with
+// POT_OVERSAMPLE 0 and without fade times, as checked by Tools/ramcheck.sh.
+//#define SERIAL_BAUD 9600
+// Record zero crossing captures, inputs and pot readings for replay by
+// Tools/sim. Sent instead of telemetry if SERIAL_BAUD is defined, or else
+// kept in tracebuf for reading via debugger. Without serial, its 34 bytes
+// with the default TRACE_SIZE fit in the MSP430G2231 with POT_OVERSAMPLE 0
+// and without fade times, as checked by Tools/ramcheck.sh. With serial, it
+// needs a device with more RAM.
+//#define TRACE
+// Trace buffer size, up to 255 bytes. By default 16, which holds the last
+// sync record and the AC cycles after it. With SERIAL_BAUD, 64 by default,
+// which holds records from before PLL lock, when bit length isn't known yet.
+// Below 48, sync records after lost records would fill it again.
+//#define TRACE_SIZE 16
+// Record interrupt latency and run time in isrprof, for reading via debugger.
+// Its 24 bytes and 8 more of stack fit in the MSP430G2231 with
+// POT_OVERSAMPLE 0 and without fade times, as checked by Tools/ramcheck.sh.
+//#define ISR_PROFILE
+// Count skipped triacdelay conversions in updstats
+//#define UPDATE_STATS
+// Count deferred case 6 tasks and late work in workstats
+//#define WORK_STATS
+// Energy and lit time metering in meter, checkpointed to information
+// memory when the lamp goes dark. Its 20 bytes fit in the MSP430G2231 with
+// POT_OVERSAMPLE 0, as checked by Tools/ramcheck.sh.
+//#define ENERGY_METER
 
 /*** Other defines ***/
 
@@ -26,23 +154,314 @@
 // Port pin usage
 #define P1_SW_OFF 1
 #define P1_LED 2
-#define P1_UNUSED 4 // P1.2 = 4 reserved in case serial is used
+#define P1_SERIAL 4 // P1.2 = 4 used for serial if SERIAL_BAUD is defined
 #define P1_SW_ON 8
 #define P1_TRIGGER 0x10
 #define P1_TRIAC 0x20
 #define P1_ZEROCROSS 0x40
 #define P1_POTCH 7 // Channel for ADC10
 #define P1_POT (1 << P1_POTCH)
+// TRIAC channels 1 and 2, in place of XIN and XOUT
+#define P2_TRIAC1 0x40
+#define P2_TRIAC2 0x80
+#define P2_TRIACS ((CHANNELS > 1 ? P2_TRIAC1 : 0) | \
+                   (CHANNELS > 2 ? P2_TRIAC2 : 0))
+
+// Fading
+#if defined(FADE_ONOFF_TIME) || defined(FADE_TRIG_TIME)
+#define FADES
+#endif
+#ifndef FADE_ONOFF_TIME
+#define FADE_ONOFF_TIME 0
+#endif
+#ifndef FADE_TRIG_TIME
+#define FADE_TRIG_TIME 0
+#endif
+#define FADE_SEG_BITS 4 // log2 of curve segments per fade
+#define FADE_SEGS (1 << FADE_SEG_BITS)
+#define FADE_NOSEG 0xFF   // fadeseg before the first segment
+#define FADE_LINEAR 0     // Linear in power
+#define FADE_PERCEPTUAL 1 // Linear in CIE lightness
+#define FADE_SCURVE 2     // Smoothstep of power, easing in and out
+#define FADE_NONE 3       // Stop fading, in state descriptors
+// Fade time in 1/10 s, from seconds which can be fractional
+#define FADE_TENTHS(s) ((unsigned short)((s) * 10 + 0.5))
+
+// Clocks
+#define SMCLK_HZ (SMCLK_MHZ * 1000000L)
+#if SMCLK_MHZ == 1
+#define TIMER_ID ID_0
+#define TIMER_DIV 1
+#define CALBC1_SMCLK CALBC1_1MHZ
+#define CALDCO_SMCLK CALDCO_1MHZ
+#elif SMCLK_MHZ == 8
+#define TIMER_ID ID_2
+#define TIMER_DIV 4
+#define CALBC1_SMCLK CALBC1_8MHZ
+#define CALDCO_SMCLK CALDCO_8MHZ
+#elif SMCLK_MHZ == 16
+#define TIMER_ID ID_3
+#define TIMER_DIV 8
+#define CALBC1_SMCLK CALBC1_16MHZ
+#define CALDCO_SMCLK CALDCO_16MHZ
+#else
+#error "SMCLK_MHZ must be 1, 8 or 16"
+#endif
+// Timer cycles per second
+#define TIMER_HZ (SMCLK_HZ / TIMER_DIV)
+// DCOx steps above calibrated value, so zero MODx doesn't make the clock
+// slower. Not at 16 MHz, which is the maximum.
+#define DCO_STEP (SMCLK_MHZ < 16 ? 1 : 0)
+// Flash timing generator divider of MCLK, for 333 kHz
+#define FLASH_DIV (SMCLK_HZ / 333333L)
+#define GATE_PULSE ((unsigned short)(TIMER_HZ * GATE_PULSE_US / 1000000L))
+#ifdef BURST_FIRE
+// triacdelay of cycles that are on. Firing at the zero crossing with a gate
+// hold turns the TRIAC on as soon as voltage is high enough.
+#define BURST_DELAY 1
+#endif
+
+// Mains
+#if MAINS_HZ == 0
+// Range of mains frequency, in Hz
+#define MAINS_MIN_HZ 45
+#define MAINS_MAX_HZ 65
+// Half-period at 55 Hz, separating 50 and 60 Hz mains
+#define HPERIOD_55HZ ((unsigned short)(TIMER_HZ / 110))
+// Whether half-period h is of 50 Hz mains
+#define MAINS_50HZ(h) ((h) > HPERIOD_55HZ)
+#define HPERIOD_NOMINAL HPERIOD_55HZ
+#elif MAINS_HZ == 50 || MAINS_HZ == 60
+#define MAINS_MIN_HZ (MAINS_HZ - MAINS_HZ / 10)
+#define MAINS_MAX_HZ (MAINS_HZ + MAINS_HZ / 10)
+#define MAINS_50HZ(h) ((void)(h), MAINS_HZ == 50)
+#define HPERIOD_NOMINAL ((unsigned short)(TIMER_HZ / (2 * MAINS_HZ)))
+#else
+#error "MAINS_HZ must be 0, 50 or 60"
+#endif
+// Half-period range for timing windows, so they are sensible before the
+// PLL has measured mains
+#define HPERIOD_MIN ((unsigned short)(TIMER_HZ / (2 * MAINS_MAX_HZ)))
+#define HPERIOD_MAX ((unsigned short)(TIMER_HZ / (2 * MAINS_MIN_HZ)))
+// Switch debounce length, in AC cycles at the highest nominal frequency
+#define DEBOUNCE_LEN ((DEBOUNCE_MS * (MAINS_HZ ? MAINS_HZ : 60) + 500) / 1000)
+
+#if defined(POT_DIRECT) && defined(BURST_FIRE)
+#error "POT_DIRECT needs phase control"
+#endif
+
+// Compile-time check, failing with a negative array size
+#define STATIC_ASSERT(name, cond) \
+    typedef char static_assert_##name[(cond) ? 1 : -1]
+// AC period in 16 bits, for pllperiod and capture differences
+STATIC_ASSERT(period_fits, TIMER_HZ / MAINS_MIN_HZ <= 0xFFFF);
+STATIC_ASSERT(flash_div, FLASH_DIV >= 1 && FLASH_DIV <= 64);
+STATIC_ASSERT(debounce_len, DEBOUNCE_LEN >= 1 && DEBOUNCE_LEN <= 255);
+STATIC_ASSERT(gate_pulse, GATE_PULSE >= 1 &&
+                          GATE_PULSE < HPERIOD_MIN >> GATE_HOLD_SHIFT);
+
+// Periodic work scheduler
+// Estimated worst case run time of deferrable tasks, and of converting
+// dimpower to triacdelay after them, in MCLK cycles
+#define TASK_POT_COST 300
+#define TASK_DEBOUNCE_COST 200
+#define CONVERT_COST (500 * CHANNELS)
+// MCLK cycles in timer cycles, rounded up
+#define MCLK_TICKS(c) ((unsigned short)(((c) + TIMER_DIV - 1) / TIMER_DIV))
+// Deferrable tasks, in order of priority
+#define TASK_POT 0x01
+#define TASK_DEBOUNCE 0x02
+
+// Channel scheduler
+// Lead of events set up from now, such as the start of serial frames
+#define CH_MINLEAD 32
+// Channel events are never handled later than this, which allows sorting
+// by time across timer wraparound
+#define CH_MAXLAG 2048
+// Events are at most an AC period ahead, so sorting needs this to fit
+STATIC_ASSERT(ch_maxlag, TIMER_HZ / MAINS_MIN_HZ + CH_MAXLAG <= 0x10000L);
+
+// Tickless idle
+#ifdef LPM3_IDLE
+// VLO period is measured over this many periods, or as many as fit before
+// the next event, every VLO_CAL_IDLES idles. Each measurement is quantized
+// to a timer cycle, and the error is multiplied by idle length.
+#define VLO_CAL_MIN 8
+#define VLO_CAL_MAX 64
+#define VLO_CAL_IDLES 32
+// Averaging of VLO period measurements, as right shift for new one weight
+#define VLO_FILTER 3
+// Fraction bits of vloperiod
+#define VLO_FRAC_BITS 7
+// Idle ends this far before the next event, as right shift of half-period
+#define IDLE_MARGIN_SHIFT 5
+// Shortest and longest idle, in VLO periods. Longer waits take more than
+// one idle. The longest lets mult() scale it by vloperiod.
+#define IDLE_MIN 2
+#define IDLE_MAX ((1 << VLO_FRAC_BITS) - 1)
+// Right shift of zchalf, in timer cycles, so half the longest half-period
+// fits
+#define ZCHALF_SHIFT (TIMER_HZ > 1000000L ? 6 : 5)
+// Timer cycles from VLO edge to Timer_A restarting from SMCLK, for DCO
+// startup, interrupt entry and TACCR0_ISR code before the restart. This is
+// the initial value, corrected from VLO edges captured after idle.
+#define IDLE_WAKE ((unsigned short)(TIMER_HZ * 2 / 1000000L + \
+                                    24 / TIMER_DIV))
+// Correction of wake time, as right shift of error
+#define IDLE_WAKE_FILTER 3
+// Idle states
+#define IDLE_OFF 0   // Timer_A from SMCLK, TACCR0 for channel events
+#define IDLE_SYNC 1  // TACCR0 capturing a VLO edge to start from
+#define IDLE_CAL 2   // TACCR0 capturing following ones, to measure period
+#define IDLE_SLEEP 3 // Timer_A from ACLK, TACCR0 compare wakes from LPM3
+
+// Slowest VLO over the longest measurement must not wrap TAR, and its
+// period must fit in vloperiod
+STATIC_ASSERT(vlo_cal, TIMER_HZ / 4000 * VLO_CAL_MAX <= 0xFFFF);
+STATIC_ASSERT(vlo_frac, TIMER_HZ / 4000 < 1 << (16 - VLO_FRAC_BITS));
+STATIC_ASSERT(zchalf, HPERIOD_MAX / 2 >> ZCHALF_SHIFT <= 0xFF);
+#endif
+
+// Serial
+#ifdef SERIAL_BAUD
+// Scheduler slot for serial bit events, after the TRIAC channels
+#define CH_SERIAL CHANNELS
+#define CH_SLOTS (CHANNELS + 1)
+// Port 1 interrupt bits not owned by user interface code
+#define P1_KEEP P1_SERIAL
+// Telemetry frame: sync, state, hperiod, dimpower, potavg, triacdelay[0],
+// then 8-bit sum of all previous bytes. Words are little-endian.
+#define SER_SYNC 0xA5
+#define SER_FRAMELEN 11
+// Commands are single bytes, with the value in the low 7 bits. Without
+// SER_CMD_TIME, fade to value, with 127 as full power, until pot is moved.
+#define SER_CMD_TIME 0x80 // Fade time for dimming commands, in 1/10 s
+#define SER_VALUE 0x7F
+#define SER_NODIM 0xFF    // serdim without a dimming command
+// Bit length as fraction of half-period, for mains frequency
+#define SER_BITFRAC(hz) ((unsigned short)(131072UL * (hz) / SERIAL_BAUD))
+STATIC_ASSERT(ser_bitfrac, 131072UL * 60 / SERIAL_BAUD <= 0xFFFF);
+#else
+#define CH_SLOTS CHANNELS
+#define P1_KEEP 0
+#endif
+
+// Trace record tags, in top 2 bits of first byte
+#define TRACE_FALL 0x00  // Falling edge capture
+#define TRACE_RISE 0x40  // Rising edge capture
+#define TRACE_IN 0x80    // Inputs in bits 0 to 2, then 16-bit time
+#define TRACE_WOKEN 0x08 // Input record from port 1 ISR, with timer stopped
+#define TRACE_ADC 0xC0   // Pot reading
+// Captures and pot readings have a signed residual from prediction, in
+// bits 0 to 4, or with TRACE_MID in bits 0 to 3 and the next byte. With
+// TRACE_ABS, the 16-bit value follows. Pot residual is in units of 8.
+#define TRACE_MID 0x20
+#define TRACE_ABS 0x30
+#define TRACE_POTSHIFT 3
+// Input records with TRACE_SYNC are sync records, followed by last and
+// interval of falling and rising captures, and last pot reading.
+#define TRACE_SYNC 0x20
+#define TRACE_LOST 0x10 // Records were lost before sync record
+#define TRACE_SYNCLEN 11
+// Inputs in trace records
+#define TRACE_SW_OFF 1
+#define TRACE_SW_ON 2
+#define TRACE_TRIGGER 4
+#ifdef TRACE
+#ifdef SERIAL_BAUD
+// AC cycles between sync records
+#define TRACE_SYNC_CYCLES 64
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 64
+#endif
+STATIC_ASSERT(trace_size, TRACE_SIZE >= 48 && TRACE_SIZE <= 255);
+#else
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 16
+#endif
+// So that tracebuf keeps the last sync record, with about 5 bytes per cycle
+#define TRACE_SYNC_CYCLES ((TRACE_SIZE - TRACE_SYNCLEN) / 5)
+STATIC_ASSERT(trace_size,
+              TRACE_SIZE >= TRACE_SYNCLEN + 5 && TRACE_SIZE <= 255);
+#endif
+// Ring index after i
+#define TRACE_NEXT(i) ((i) == TRACE_SIZE - 1 ? 0 : (i) + 1)
+#endif
+
+// Pot sampling
+#if POT_OVERSAMPLE
+#define POT_SAMPLES ((1 << POT_OVERSAMPLE) + 2)
+// Averaging of pot readings, as right shift for new reading weight
+#define POT_FILTER 2
+#else
+#define POT_FILTER 3
+#endif
 
 // Register values
 // Zero crossing detector:
 #define ZC_CCTL (CCIS_1 | SCS | CAP | CCIE)
+// ADC10 clock. SMCLK stops in LPM3, so idle uses the internal ADC10OSC.
+#ifdef LPM3_IDLE
+#define ADC10SSEL_POT ADC10SSEL_0
+#else
+#define ADC10SSEL_POT ADC10SSEL_3
+#endif
+#if POT_OVERSAMPLE
+// P1_POTCH channel, ADC10SC, binary, sample and hold not inverted,
+// divide by 8, ADC10SSEL_POT clock, repeat single channel
+#define ADC10CTL1_VAL ((P1_POTCH << 12) | ADC10DIV_7 | ADC10SSEL_POT | \
+                       CONSEQ_2)
+// VCC to VSS, sample for 64*ADC10CLKs, not set for low sampling rate,
+// reference off, multiple samples, ADC10 on, interrupt at end of block.
+// Samples are 616 SMCLK cycles apart, so the default block of 4 spans a
+// seventh of an AC cycle, averaging out more than just conversion noise.
+// From ADC10OSC, it takes about 0.5 ms.
+#define ADC10CTL0_VAL (ADC10SHT_3 | MSC | ADC10ON | ADC10IE)
+#else
 // P1_POTCH channel, ADC10SC, binary, sample and hold not inverted
-// divider zero, SMCLK,
-#define ADC10CTL1_VAL ((P1_POTCH << 12) | ADC10SSEL_3)
+// divider zero, ADC10SSEL_POT clock
+#define ADC10CTL1_VAL ((P1_POTCH << 12) | ADC10SSEL_POT)
 // VCC to VSS, sample for 4*ADC10CLKs, not set for low sampling rate,
 // reference off, single sample, ADC10 on
 #define ADC10CTL0_VAL (ADC10ON)
+#endif
+
+/* Worst case stack use in bytes, checked against RAM by Tools/ramcheck.sh.
+ * It is reached by an interrupt nesting in the dimpower conversion at the
+ * end of TACCR1_ISR, which runs with interrupts enabled. Interrupt
+ * functions save each register they use, and R12 to R15 if they call
+ * functions, while other functions save the registers from R4 to R11 they
+ * use. Frames, with registers estimated from what is live:
+ * - main(): 2 for its return address. As a __task, it saves no registers.
+ *   Its flash saves run with interrupts disabled, and reach 12.
+ * - TACCR1_ISR: 12 for PC and SR and R12 to R15. zc_cycle() is not
+ *   inlined, so the registers case 6 needs are freed before conversion.
+ * - Conversion: 16 for dim_convert() with 2 registers, dimdelay() with 3
+ *   and mult(). fade_segment() with 5 registers and mult() needs 14.
+ * - Nested TACCR0_ISR: 16 for PC and SR and 6 registers, when it calls no
+ *   functions. Port 1 and ADC10 ISRs need less.
+ * IAR's stack usage analysis gives exact figures for a build. */
+#ifdef LPM3_IDLE
+// TACCR0_ISR also saves R12 to R15 for idle calls, and idle_edge() with 5
+// registers calls idle_end() or mult()
+#define STACK_CCR0 36
+#elif defined(SERIAL_BAUD)
+// As below, with 4 more for ser_event() calling ser_framebyte()
+#define STACK_CCR0 28
+#elif CH_SLOTS > 1
+// TACCR0_ISR also saves R12 to R15 for scheduler calls, and keeps 4
+// registers across them
+#define STACK_CCR0 24
+#else
+#define STACK_CCR0 16
+#endif
+#ifdef ISR_PROFILE
+// TACCR1_ISR keeps profentry and profidx, and TACCR0_ISR profentry and lat
+#define STACK_PROF 8
+#else
+#define STACK_PROF 0
+#endif
+#define STACK_BYTES (2 + 12 + 16 + STACK_CCR0 + STACK_PROF)
 
 __cc_version2 unsigned short mult(unsigned short a, unsigned short b);
 
@@ -52,18 +471,65 @@ static unsigned char state = STATE_INITIAL; // Current operating mode
 
 // Variables for phase control based on timer A cycles
 static char zcmode;                   // Zero crossing detector state
-static unsigned short hperiod;        // Half of AC period
-static unsigned short zerocross;      // TAR value for zero crossing
-static unsigned short triacdelay = 0; // Delay after zero crossing
-                                      // Zero disables TRIAC driver
+static unsigned long pllphase;        // Predicted peak time, 16.16 fixed point
+static unsigned long pllperiod;       // AC period, 16.16 fixed point
+static unsigned short pllpeak;        // Measured time of last peak
+static unsigned char plllock;         // Consecutive good cycles, saturating
+                                      // PLL is locked at PLL_LOCKED
+static bool pllstart = true;          // Zero crossing detection started
+static unsigned short hperiod = HPERIOD_NOMINAL; // Half of AC period,
+                                      // limited to mains range
+static unsigned short triacdelay[CHANNELS]; // Delay after zero crossing
+                                      // Zero disables channel
+static unsigned short delayhperiod;   // Half-period used for triacdelay,
+                                      // 0 when it must be converted again
+static unsigned short curdimpower;    // dimpower used for triacdelay
+#ifdef BURST_FIRE
+static unsigned short burstpower[CHANNELS]; // Fraction of cycles on,
+                                      // 0xFFFF == 1.0. Zero disables channel
+static unsigned short burstacc[CHANNELS]; // Sigma-delta accumulators
+#endif
+
+#ifdef LPM3_IDLE
+// Variables for tickless idle
+static unsigned char idlemode = IDLE_OFF;
+static unsigned short vloperiod;      // VLO period in timer cycles, with
+                                      // VLO_FRAC_BITS fraction bits. Zero
+                                      // until measured.
+static unsigned char vlocal;          // Idles until next measurement
+static unsigned char idlecal;         // VLO periods measured so far
+static unsigned short idlefrom;       // Time of VLO edge idle starts from
+static unsigned short idleref;        // Time of VLO edge ending idle
+static bool idlerefok;                // idleref is from this AC cycle
+static unsigned short idlewake = IDLE_WAKE << 4; // Timer cycles from that
+                                      // edge to restart, 12.4 fixed point
+static unsigned char zchalf;          // Half of optocoupler activation,
+                                      // for predicting its edges from
+                                      // pllpeak
+#endif
 
 // Variables for linear dimming
-static unsigned short dimpower = 0;  // Set by fading code in ISR, used by
-                                     // main code to calculate triacdelay.
-static bool updatedim;               // Set by ISR when dimpower updated,
-                                     // used to ensure requested value is set.
-static unsigned short dimtarget = 0; // Target for current fade
-static unsigned short dimdelta = 0;  // Light output change per AC cycle
+static unsigned short dimpower = 0;  // Set by fading code in ISR, used
+                                     // to calculate triacdelay.
+static bool updatedim;               // Set when dimpower or hperiod changed,
+                                     // so TACCR1_ISR converts dimpower.
+
+#ifdef FADES
+// Variables for fading, set when fade is started by TACCR1_ISR
+static unsigned short fadefrom;      // dimpower at start of fade
+static unsigned short fadetarget;    // Target for current fade
+static unsigned short fadelen;       // Fade length, in AC cycles
+static unsigned char fadecurve = FADE_NONE; // Curve for current fade,
+                                     // FADE_NONE when not fading
+static unsigned char fadeseg;        // Current segment
+static unsigned short fadeleft;      // AC cycles left in segment, 0 when
+                                     // the next one must be started
+static unsigned short fadefrac;      // Fraction of dimpower, 0x10000 == 1
+static unsigned long fadedec;        // dimpower change per AC cycle, 16.16
+#define fading (fadecurve != FADE_NONE) // Fade in progress
+#else
+#define fading false
+#endif
 
 // Variables for user input
 static unsigned short potavg = 0;           // Averaged potentiometer value
@@ -72,16 +538,1250 @@ static unsigned char debctr = DEBOUNCE_LEN; // Switch debounce counter
                                             // Decremented once per AC cycle
                                             // until zero when debouncing ends
 static unsigned char inputval = 0xFF;       // Previous input, for debouncing
+#ifdef POT_DIRECT
+static unsigned short potdim;               // potavg that set dimpower
+static bool potdirect;                      // dimpower is from potdim
+#endif
+#if POT_OVERSAMPLE
+static unsigned short potbuf[POT_SAMPLES];  // Filled by ADC10 DTC
+#endif
+
+// Variables for scheduling periodic work in case 6 of TACCR1_ISR
+static unsigned char taskdeferred;   // Tasks deferred in the last AC cycle
+
+/*** Interrupt profiling ***/
+#ifdef ISR_PROFILE
+// Latency histogram bin width is 1 << PROF_BINSHIFT timer cycles
+#define PROF_BINSHIFT 4
+#define PROF_BINS 8
+// Run time slots in isrprof
+#define PROF_CCR0 0
+#define PROF_CCR1 1 // TACCR1 ISR uses 1 to 4, for zcmode 0 to 6
+#define PROF_PORT1 5
+#define PROF_ADC10 6
+#define PROF_NUM 7
+
+static struct {
+    unsigned char lathist[PROF_BINS];  // TACCR0 compare to ISR entry,
+                                       // last bin also counts longer ones
+    unsigned short latmax;             // Longest TACCR0 latency
+    unsigned short costmax[PROF_NUM];  // Longest ISR run time
+} isrprof;
+
+// Timestamp ISR entry
+#define PROF_ENTRY() unsigned short profentry = TAR
+// Timestamp ISR exit and record run time in slot idx
+#define PROF_EXIT(idx) do { \
+    unsigned short profcost = TAR - profentry; \
+    if (profcost > isrprof.costmax[idx]) isrprof.costmax[idx] = profcost; \
+} while (0)
+#else
+#define PROF_ENTRY()
+#define PROF_EXIT(idx)
+#endif
+
+/*** Update statistics ***/
+#ifdef UPDATE_STATS
+static struct {
+    unsigned short wakeskip;    // Pot readings not needing conversion
+    unsigned short hwake;       // Conversions only due to half-period change
+    unsigned short convskip;    // Conversions reusing triacdelay
+} updstats;
+
+// Increment counter, saturating instead of wrapping
+#define UPDSTAT(x) do { if (updstats.x != 0xFFFF) updstats.x++; } while (0)
+#else
+#define UPDSTAT(x)
+#endif
+
+/*** Saved mains period ***/
+/* The period at the last lock is kept in information memory, so zero
+ * crossing tracking can start from the first optocoupler pulse after
+ * reset. Records are appended to a log in segments D to C to B, and the
+ * next segment is erased when one fills, so the newest record is always
+ * followed by an erased one. Each segment is erased once per 16 saves.
+ * With ENERGY_METER, the log is only segment D, which is erased by the
+ * save after it fills. A power failure during that save loses the period,
+ * so the PLL starts from scratch once. Saving is only done before entering
+ * LPM4, when TRIACs are off and the CPU can be held for the erase. Segment
+ * A has DCO calibration. */
+
+#ifdef ENERGY_METER
+// Segments C and B hold meter checkpoints instead
+#define PLLSAVE_RECS 16
+#else
+#define PLLSAVE_RECS 48
+#endif
+#define PLLSAVE_SEGRECS 16
+// Also covers timer rate, so records saved at another rate are ignored
+#define PLLSAVE_CHECK(period, hz) \
+    ((unsigned char)((period) + ((period) >> 8) + (hz)) ^ 0x5A ^ \
+     (unsigned char)(TIMER_HZ / 1000000L - 1))
+
+struct pllsave {
+    unsigned short period;  // AC period, in timer cycles
+    unsigned char hz;       // Mains frequency class, 50 or 60
+    unsigned char check;    // PLLSAVE_CHECK, for detecting partial writes
+};
+
+#pragma location = 0x1000
+__no_init static struct pllsave pllsaved[PLLSAVE_RECS];
+static unsigned char pllsavenext;       // Log position for next save
+
+// Mains frequency class of period
+static unsigned char pll_hz(unsigned short period)
+{
+    return MAINS_50HZ(period >> 1) ? 50 : 60;
+}
+
+// Newest record, or 0 if it isn't valid
+static unsigned short pll_saved(void)
+{
+    struct pllsave *p = &pllsaved[(pllsavenext == 0 ? PLLSAVE_RECS :
+                                   pllsavenext) - 1];
+
+    if (p->check != PLLSAVE_CHECK(p->period, p->hz) ||
+        p->hz != pll_hz(p->period)) return 0;
+    return p->period;
+}
+
+// Find end of log, at reset
+static void pll_load(void)
+{
+    unsigned char i;
+
+    // First erased record after a written one, or start if all are erased
+    for (i = 0; i < PLLSAVE_RECS; i++) {
+        if (pllsaved[i].period == 0xFFFF &&
+            pllsaved[i == 0 ? PLLSAVE_RECS - 1 : i - 1].period != 0xFFFF) {
+            break;
+        }
+    }
+    pllsavenext = i == PLLSAVE_RECS ? 0 : i;
+}
+
+// Erase segment of record, with flash unlocked
+static void pll_erase(struct pllsave *p)
+{
+    FCTL1 = FWKEY | ERASE;
+    p->period = 0; // Dummy write starts erase, and CPU waits for it
+}
+
+// Save period if it changed, from main thread before entering LPM4, with
+// interrupts disabled because flash access must not be interrupted
+static void pll_save(unsigned short period)
+{
+    struct pllsave *p = &pllsaved[pllsavenext];
+    unsigned short delta = period - pll_saved() + PLLSAVE_TOLERANCE;
+    unsigned char hz = pll_hz(period);
+
+    if (delta <= 2 * PLLSAVE_TOLERANCE) return;
+
+    FCTL3 = FWKEY;
+    // Log may not have been erased, for example before first save
+    if (p->period != 0xFFFF || p->hz != 0xFF || p->check != 0xFF) {
+        pll_erase(p);
+    }
+    FCTL1 = FWKEY | WRT;
+    p->period = period;
+    p->hz = hz;
+    p->check = PLLSAVE_CHECK(period, hz);
+    if (++pllsavenext == PLLSAVE_RECS) pllsavenext = 0;
+#if PLLSAVE_RECS > PLLSAVE_SEGRECS
+    // Keep an erased record after the newest one
+    if (pllsavenext % PLLSAVE_SEGRECS == 0) pll_erase(&pllsaved[pllsavenext]);
+#endif
+    FCTL1 = FWKEY;
+    FCTL3 = FWKEY | LOCK;
+}
+
+/*** Dimming table, translating desired output power to trigger angle ***/
+// Generated by Tools/dimtab, along with dimdelay()
+#ifndef BURST_FIRE
+#include DIMTAB_H
+STATIC_ASSERT(dimtab_hperiod, TIMER_HZ / (2 * MAINS_MIN_HZ) <=
+                              DIMTAB_MAX_HPERIOD);
+#endif
+#ifdef POT_DIRECT
+// Composite table from pot value, generated by Tools/dimtab -a, along
+// with potdelay()
+#include POTTAB_H
+STATIC_ASSERT(pottab_hperiod, TIMER_HZ / (2 * MAINS_MIN_HZ) <=
+                              POTTAB_MAX_HPERIOD);
+STATIC_ASSERT(pottab_offset, POTTAB_OFFSET == POT_OFFSET);
+#endif
+
+/*** Energy metering ***/
+#ifdef ENERGY_METER
+/* Case 6 of TACCR1_ISR counts each AC cycle at constant cost, with only
+ * additions: delivered energy as half-cycles at full power, half-cycles
+ * with channel 0 lit, and AC cycles lit in the triggered and on states.
+ * Time in the other states is only fading out and debouncing, so it isn't
+ * counted. With phase control, the square root of power is linear in
+ * dimpower, as in Tools/dimtab, so dim_convert() computes power from
+ * curdimpower with two mult() calls, only when it changes. With burst
+ * fire, cycles that are on count at full power. Channel scaling isn't
+ * applied. Time dark in LPM4 isn't counted, because no clock runs then.
+ *
+ * Before entering LPM4, meter is checkpointed if it changed, to a ring of
+ * records filling segments C and B. A segment is only erased for writing
+ * into it while the newest valid record is in the other one, so a power
+ * failure during a checkpoint loses at most that checkpoint. The valid
+ * record with the highest sequence number is loaded at reset, and found
+ * again for each checkpoint, instead of keeping its index. Counts since
+ * the last checkpoint are lost at power failure. */
+
+#define METERSAVE_RECS 4
+#define METERSAVE_SEGRECS 2
+#define METER_WORDS (sizeof(struct meter) / sizeof(unsigned short))
+#ifndef BURST_FIRE
+// Square root of power at dimpower 0, with 0x10000 == 1.0
+#define METER_P0 ((unsigned short)(DIMTAB_P0 * 65536 + 0.5))
+#endif
+
+// 32-bit counters as 16-bit words, low word first, so the layout is the
+// same when the firmware is built for the simulator
+struct meter {
+    unsigned short energyfrac;  // Fraction of energy, 0x10000 == 1
+    unsigned short energy[2];   // Energy, in half-cycles at full power
+    unsigned short lit[2];      // Half-cycles with channel 0 TRIAC active
+    unsigned short dwell[2][2]; // AC cycles lit in STATE_TRIGGERED and
+                                // STATE_ON
+};
+
+struct metersave {
+    struct meter m;
+    unsigned short seq;         // Checkpoint number, for finding newest
+    unsigned short check;       // meter_check() plus seq, for partial writes
+    unsigned short pad[5];      // Left erased, so records tile segments
+};
+
+STATIC_ASSERT(metersave, sizeof(struct metersave) * METERSAVE_SEGRECS == 64);
+
+#pragma location = 0x1040
+__no_init static struct metersave metersaved[METERSAVE_RECS];
+static struct meter meter;              // Counts, also read via debugger
+#ifndef BURST_FIRE
+static unsigned short meterpower;       // Power at curdimpower, if lit
+#endif
+
+// Add to 32-bit counter. The carry is added without branching.
+static void meter_add(unsigned short *c, unsigned short n)
+{
+    unsigned short lo = c[0] + n;
+
+    c[1] += lo < n;
+    c[0] = lo;
+}
+
+// Count an AC cycle, from case 6 of TACCR1_ISR after firing is set up
+static void meter_cycle(void)
+{
+    unsigned short lit = triacdelay[0] != 0;
+#ifdef BURST_FIRE
+    // Full power if lit, or else 0
+    unsigned short power = -lit;
+#else
+    // Power if lit, or else 0
+    unsigned short power = meterpower & -lit;
+#endif
+    unsigned short frac = meter.energyfrac;
+
+    // Two half-cycles at power
+    meter.energyfrac = frac + (power << 1);
+    meter_add(meter.energy, (power >> 15) + (meter.energyfrac < frac));
+    meter_add(meter.lit, lit << 1);
+    // Lit in STATE_TRIGGERED or STATE_ON, which have bit 1 set
+    if (state & (lit << 1)) meter_add(meter.dwell[state & 1], 1);
+}
+
+#ifndef BURST_FIRE
+// Power at dimpower p, with 0xFFFF == 1.0, from dim_convert()
+static unsigned short meter_power(unsigned short p)
+{
+    unsigned short root = METER_P0 + mult(p, 0xFFFF - METER_P0);
+
+    return mult(root, root);
+}
+#endif
+
+static unsigned short meter_check(const struct meter *m)
+{
+    const unsigned short *w = (const unsigned short *)m;
+    unsigned short sum = 0x5AA5;
+    unsigned char i;
+
+    for (i = 0; i < METER_WORDS; i++) sum += w[i] ^ (sum << 1);
+    return sum;
+}
+
+// Whether checkpoint was completely written
+static bool meter_valid(const struct metersave *p)
+{
+    return p->check == (unsigned short)(meter_check(&p->m) + p->seq);
+}
+
+// Index of newest valid checkpoint, or METERSAVE_RECS if there is none
+static unsigned char meter_newest(void)
+{
+    unsigned char i, newest = METERSAVE_RECS;
+
+    for (i = 0; i < METERSAVE_RECS; i++) {
+        if (!meter_valid(&metersaved[i])) continue;
+        if (newest == METERSAVE_RECS ||
+            (short)(metersaved[i].seq - metersaved[newest].seq) > 0) {
+            newest = i;
+        }
+    }
+    return newest;
+}
+
+// Load newest checkpoint, at reset
+static void meter_load(void)
+{
+    unsigned char newest = meter_newest();
+
+    if (newest < METERSAVE_RECS) meter = metersaved[newest].m;
+}
+
+// Checkpoint meter if it changed, from main thread before entering LPM4,
+// with interrupts disabled because flash access must not be interrupted
+static void meter_save(void)
+{
+    unsigned char next = meter_newest();
+    const unsigned short *w = (const unsigned short *)&meter;
+    unsigned short seq = 0;
+    unsigned short *dst;
+    struct metersave *p;
+    unsigned char i;
+
+    if (next < METERSAVE_RECS) {
+        const struct metersave *last = &metersaved[next];
+        const unsigned short *old = (const unsigned short *)&last->m;
+
+        // Unchanged since newest checkpoint
+        for (i = 0; i < METER_WORDS && w[i] == old[i]; i++);
+        if (i == METER_WORDS) return;
+        seq = last->seq + 1;
+    }
+    // Record after the newest, or the first if there is none
+    if (++next >= METERSAVE_RECS) next = 0;
+
+    FCTL3 = FWKEY;
+    // Next record not erased, after a full ring or a partial write. If it
+    // shares a segment with the newest record, use the other segment.
+    dst = (unsigned short *)&metersaved[next];
+    for (i = 0; i < sizeof(struct metersave) / sizeof(unsigned short) &&
+                dst[i] == 0xFFFF; i++);
+    if (i < sizeof(struct metersave) / sizeof(unsigned short)) {
+        if (next % METERSAVE_SEGRECS != 0) {
+            next += METERSAVE_SEGRECS - next % METERSAVE_SEGRECS;
+            if (next == METERSAVE_RECS) next = 0;
+        }
+        FCTL1 = FWKEY | ERASE;
+        metersaved[next].check = 0; // Dummy write starts erase
+    }
+    p = &metersaved[next];
+    FCTL1 = FWKEY | WRT;
+    dst = (unsigned short *)&p->m;
+    for (i = 0; i < METER_WORDS; i++) dst[i] = w[i];
+    p->seq = seq;
+    p->check = meter_check(&meter) + seq;
+    FCTL1 = FWKEY;
+    FCTL3 = FWKEY | LOCK;
+}
+#endif
+
+/*** Channel scheduler ***/
+/* Firing and gate hold end events of all channels are kept in chorder,
+ * sorted by time, and TA0.0 compares at the first one. Channel 0 drives
+ * the TA0.0 output on P1.5, so its events are timed by hardware when
+ * first. Other channels are on port 2 and driven by TACCR0_ISR. Each
+ * channel has its own zero crossing reference, so events of a channel
+ * can be past the start of the next half-cycle. With a single slot,
+ * chorder is left out, and the slot has an event while it is queued. */
+
+// Channel bit in masks, matching port 2 pin for channels after 0.
+// Serial uses the slot after the last channel.
+static const unsigned char chbit[] = { 0x01, P2_TRIAC1, P2_TRIAC2, 0x02 };
+static const unsigned short chscale[] = CHANNEL_SCALE;
+
+static unsigned short chzc[CHANNELS];   // Zero crossing for next firing
+static unsigned short chtime[CH_SLOTS]; // Time of next event
+#if CH_SLOTS > 1
+static unsigned char chorder[CH_SLOTS]; // Channels with events, by time
+static unsigned char chnum;             // Number of channels in chorder
+#define CH_FIRST() chorder[0]
+#define CH_ANY() (chnum > 0)
+#else
+#define CH_FIRST() 0
+#define CH_ANY() (chqueued != 0)
+#endif
+static unsigned char chqueued;          // Mask of channels in chorder
+static unsigned char chhold;            // Mask of channels holding gate on
+
+#if CH_SLOTS > 1
+// Insert channel into chorder, by time of its event
+static void ch_insert(unsigned char ch)
+{
+    unsigned short ref = TAR - CH_MAXLAG;
+    unsigned short t = chtime[ch] - ref;
+    unsigned char i = chnum++;
+
+    while (i > 0 && (unsigned short)(chtime[chorder[i - 1]] - ref) > t) {
+        chorder[i] = chorder[i - 1];
+        i--;
+    }
+    chorder[i] = ch;
+    chqueued |= chbit[ch];
+}
+
+// Remove channel from chorder
+static void ch_remove(unsigned char ch)
+{
+    unsigned char i, j = 0;
+
+    for (i = 0; i < chnum; i++) {
+        if (chorder[i] != ch) chorder[j++] = chorder[i];
+    }
+    chnum = j;
+    chqueued &= ~chbit[ch];
+}
+
+// Remove first channel from chorder, from TACCR0_ISR
+static void ch_pop(void)
+{
+    unsigned char i;
+
+    for (i = 1; i < chnum; i++) chorder[i - 1] = chorder[i];
+    chnum--;
+    chqueued &= ~chbit[CH_FIRST()];
+}
+#else
+// The single slot is queued while its bit is in chqueued. As macros, these
+// don't make TACCR0_ISR call functions.
+#define ch_insert(ch) (chqueued |= chbit[ch])
+#define ch_remove(ch) (chqueued &= ~chbit[ch])
+#define ch_pop() (chqueued = 0)
+#endif
+
+// Set up TA0.0 compare for first event in chorder. It is inlined into
+// TACCR0_ISR, which then calls no functions with a single slot.
+#pragma inline=forced
+static void ch_compare(void)
+{
+    unsigned char ch = CH_FIRST();
+    // TA0.0 output is only on while channel 0 holds the gate
+    unsigned short out = OUTMOD_0 | ((chhold & chbit[0]) ? OUT : 0);
+
+#ifdef LPM3_IDLE
+    // Stop capturing VLO edges for starting idle
+    idlemode = IDLE_OFF;
+#endif
+    if (!CH_ANY()) {
+        TACCTL0 = out;
+        return;
+    }
+
+    // Avoid output change while compare is moved
+    TACCTL0 = out | CCIE;
+    TACCR0 = chtime[ch];
+    if (ch == 0) {
+        // Fire or end gate hold at compare
+        TACCTL0 = ((chhold & chbit[0]) ? OUTMOD_5 : OUTMOD_1) | CCIE;
+    }
+
+    // Let TACCR0_ISR handle events that are already due
+    if ((short)(chtime[ch] - TAR) <= 0) TACCTL0 |= CCIFG;
+}
+
+// Set up TA0.0 compare for first event in chorder
+static void ch_arm(void)
+{
+    ch_compare();
+}
+
+/*** Tickless idle ***/
+#ifdef LPM3_IDLE
+/* While lit, the CPU waits in LPM0 with Timer_A clocked from SMCLK. When
+ * the next channel event and zero crossing detector event are far enough
+ * ahead, TA0.0 captures a VLO edge from ACLK. From there, Timer_A counts
+ * VLO periods, and TACCR0_ISR returns to LPM3. A compare after a whole
+ * number of periods wakes it a margin before the event, and TAR is
+ * restored to the captured time plus that many periods and the wake time.
+ * Zero crossing detection pauses while idle.
+ *
+ * Every VLO_CAL_IDLES idles, TA0.0 keeps capturing VLO edges until the
+ * event instead, measuring the period against SMCLK. The first VLO edge
+ * captured after an idle shows how far off the restored TAR was, which
+ * corrects the wake time. Remaining error is seen by the PLL at the next
+ * capture, and corrected like phase noise. Any ch_arm() call cancels idle
+ * before it starts, and port 1 ISR cancels it while sleeping. */
+
+// TACCTL1 of each zcmode, restored after idle
+static const unsigned short idlecctl1[] = { CM_2 | ZC_CCTL, CCIE,
+                                            CM_1 | ZC_CCTL, CCIE };
+
+// Timer cycles in n VLO periods, rounded down, for n up to IDLE_MAX
+#define VLO_TICKS(n) mult((n) << (16 - VLO_FRAC_BITS), vloperiod)
+
+/* Time idle must end by, a margin before the next channel or zero crossing
+ * detector event. Compares are known, and captures are zchalf either side
+ * of the peak a period after pllpeak, which is updated after the rising
+ * edge. The measured peak is used rather than the PLL's prediction, which
+ * lags after a phase step. */
+static unsigned short idle_end(void)
+{
+    unsigned short end;
+
+    if (!(TACCTL1 & CAP)) {
+        end = TACCR1;
+    } else {
+        unsigned short half = (unsigned short)zchalf << ZCHALF_SHIFT;
+
+        end = pllpeak + (unsigned short)(pllperiod >> 16);
+        end += (TACCTL1 & CM_3) == CM_1 ? half : -half;
+    }
+    if (CH_ANY() && (short)(chtime[CH_FIRST()] - end) < 0) {
+        end = chtime[CH_FIRST()];
+    }
+    return end - (hperiod >> IDLE_MARGIN_SHIFT);
+}
+
+// Start capturing VLO edges if idle is possible, from end of a Timer_A
+// ISR with interrupts disabled
+static void idle_start(void)
+{
+    if (idlemode != IDLE_OFF || plllock < PLL_LOCKED ||
+        (TACCTL1 & (CCIE | CCIFG)) != CCIE || (TACCTL0 & CCIFG)) return;
+    if ((short)(idle_end() - TAR) <
+        (short)((IDLE_MIN + 1) * (vloperiod >> VLO_FRAC_BITS))) return;
+
+    idlemode = IDLE_SYNC;
+    // Capture rising edges of ACLK, with TA0.0 output kept as it is
+    TACCTL0 = OUTMOD_0 | ((chhold & chbit[0]) ? OUT : 0) |
+              CM_1 | CCIS_1 | SCS | CAP | CCIE;
+}
+
+/* Handle VLO edge captured by TA0.0, from TACCR0_ISR. sleep is whether
+ * TACCR0_ISR returns to LPM0. Returns true if Timer_A now counts VLO
+ * periods, so TACCR0_ISR should return to LPM3 instead. */
+static bool idle_edge(bool sleep)
+{
+    unsigned short t = TACCR0, end = idle_end(), len;
+    unsigned short per = vloperiod >> VLO_FRAC_BITS;
+
+    if (idlemode == IDLE_CAL) {
+        // Measure over as many periods as there is time for. An edge
+        // captured before this ISR ran would be missing from the count.
+        idlecal++;
+        if (per == 0) per = (unsigned short)(t - idlefrom) / idlecal;
+        if ((short)(end - t) >= (short)(2 * per) &&
+            idlecal < VLO_CAL_MAX && !(TACCTL0 & COV)) return false;
+        if (idlecal >= VLO_CAL_MIN && !(TACCTL0 & COV)) {
+            // Whole and fraction parts divided apart, so no 32 bit
+            // division is needed
+            unsigned short d = t - idlefrom;
+            unsigned short cal = (d / idlecal << VLO_FRAC_BITS) +
+                                 (d % idlecal << VLO_FRAC_BITS) / idlecal;
+
+            if (vloperiod == 0) vloperiod = cal;
+            else if (cal > vloperiod) vloperiod += (cal - vloperiod) >>
+                                                   VLO_FILTER;
+            else vloperiod -= (vloperiod - cal) >> VLO_FILTER;
+            vlocal = VLO_CAL_IDLES;
+        }
+        ch_arm();
+        return false;
+    }
+
+    if (idlerefok) {
+        /* This edge should be whole VLO periods after the one that ended
+         * the last idle, if TAR was restored correctly. Longer gaps are
+         * left unchecked. VLO_TICKS() rounds down, which makes err half a
+         * timer cycle high on average, so that is taken off. */
+        len = (unsigned short)(t - idleref + (per >> 1)) / per;
+        if (len <= IDLE_MAX) {
+            short err = t - idleref - VLO_TICKS(len);
+
+            idlewake -= (err * 16 - 8) >> IDLE_WAKE_FILTER;
+        }
+        idlerefok = false;
+    }
+    idlefrom = t;
+    if (vlocal == 0) {
+        // Measure period now, unless it's known and there isn't time
+        if (per == 0 ||
+            (short)(end - t) >= (short)((VLO_CAL_MIN + 2) * per)) {
+            idlemode = IDLE_CAL;
+            idlecal = 0;
+            return false;
+        }
+    } else {
+        vlocal--;
+    }
+
+    /* Give up if main thread is running, if TACCR1_ISR is pending, if the
+     * idle would be too short, or if this ISR was so late that Timer_A
+     * would miss the next edge. Idle length is rounded down, with period
+     * rounded up. The restored TAR is rounded down, which the wake time
+     * correction takes up. */
+    per++;
+    if (!sleep || (TACCTL1 & CCIFG) ||
+        (short)(end - t) < (short)(IDLE_MIN * per) ||
+        (unsigned short)(TAR - t) > per >> 1) {
+        ch_arm();
+        return false;
+    }
+
+    len = (unsigned short)(end - t) / per;
+    if (len > IDLE_MAX) len = IDLE_MAX;
+    idleref = t + VLO_TICKS(len);
+    // Pause zero crossing detection, which zcmode restarts, and count VLO
+    // periods
+    TACCTL1 = 0;
+    TACTL = TASSEL_1 | TACLR;
+    TACCR0 = len;
+    TACCTL0 = OUTMOD_0 | ((chhold & chbit[0]) ? OUT : 0) | CCIE;
+    TACTL = TASSEL_1 | MC_2;
+    idlemode = IDLE_SLEEP;
+    return true;
+}
+
+// Restart Timer_A from SMCLK, woken from VLO edge at idleref plus extra
+// timer cycles. Channel events must be armed afterwards. idleref was
+// rounded down, so half a timer cycle is added for rounding it.
+static void idle_wake(unsigned short extra)
+{
+    TACTL = TASSEL_2 | TIMER_ID | TACLR;
+    TAR = idleref + ((idlewake + 16) >> 4) + extra;
+    TACTL = TASSEL_2 | TIMER_ID | MC_2;
+    TACCTL1 = idlecctl1[zcmode >> 1];
+    idlemode = IDLE_OFF;
+    idlerefok = true;
+}
+
+// Cancel idle from port 1 ISR, which needs TAR and the scheduler
+static void idle_cancel(void)
+{
+    if (idlemode == IDLE_OFF) return;
+    if (idlemode == IDLE_SLEEP) {
+        // Time within current VLO period is unknown
+        TACTL = TASSEL_1;
+        idleref = idlefrom + VLO_TICKS(TAR);
+        idle_wake(vloperiod >> (VLO_FRAC_BITS + 1));
+        idlerefok = false;
+    }
+    ch_arm();
+}
+#endif
+
+/*** Fading ***/
+/* A fade follows a curve from fadefrom to fadetarget, approximated by
+ * FADE_SEGS linear segments of nearly equal length in AC cycles. Curves give
+ * power, and are mapped to dimpower for a fade over the whole range. With
+ * phase control, dimpower is linear in the square root of power, so
+ * Tools/dimtab derives them through its dimming curve. Fades over part of
+ * the range scale the same dimpower curve, so power only approximately
+ * follows the curve.
+ *
+ * When a segment starts, the end of TACCR1_ISR sets dimpower from the
+ * curve, and computes its change per AC cycle from a reciprocal of the
+ * segment length refined with mult(), so no division or 32 bit multiply
+ * routines are needed. Within a segment, TACCR1_ISR only adds that change
+ * and counts down the cycles left, so the AC cycle costs no mult(). The
+ * fade ends exactly at fadetarget after fadelen cycles. A new target means
+ * a new fade, from where dimpower is. */
+
+#ifdef FADES
+// Curve values at segment ends, for fades with increasing dimpower.
+// Decreasing fades follow the curve backwards from fadetarget.
+#ifdef BURST_FIRE
+// dimpower is linear in power
+static const unsigned short fadecurves[][FADE_SEGS + 1] = {
+    // t
+    { 0, 4096, 8192, 12288, 16384, 20480, 24576, 28672, 32768, 36863,
+      40959, 45055, 49151, 53247, 57343, 61439, 65535 },
+    // Relative luminance for CIE lightness 100*t
+    { 0, 453, 972, 1762, 2894, 4429, 6429, 8956, 12071, 15835,
+      20310, 25558, 31639, 38616, 46550, 55503, 65535 },
+    // 3*t^2 - 2*t^3
+    { 0, 736, 2816, 6048, 10240, 15200, 20736, 26656, 32768, 38879,
+      44799, 50335, 55295, 59487, 62719, 64799, 65535 }
+};
+#else
+#define fadecurves dimtab_fade
+STATIC_ASSERT(dimtab_fade, DIMTAB_FADE_SEG_BITS == FADE_SEG_BITS);
+#endif
+
+// Fade length in AC cycles, from time in 1/10 s, at least one
+static unsigned short fade_cycles(unsigned short time)
+{
+    unsigned long n = ((unsigned long)time << 2) +
+                      (MAINS_50HZ(hperiod) ? time : (unsigned long)time << 1);
+
+    if (n > 0xFFFF) return 0xFFFF;
+    return n != 0 ? n : 1;
+}
+
+// Start fade from current dimpower, from TACCR1_ISR. The end of
+// TACCR1_ISR starts its first segment.
+static void fade_start(unsigned short target, unsigned short len,
+                       unsigned char curve)
+{
+    fadefrom = dimpower;
+    fadetarget = target;
+    fadelen = len;
+    fadecurve = curve;
+    fadeseg = FADE_NOSEG;
+    fadeleft = 0;
+    updatedim = true;
+#ifdef POT_DIRECT
+    potdirect = false;
+#endif
+}
+
+// AC cycles from start of fade to end of segment, which is 0 for
+// FADE_NOSEG. Multiplying by the segment number is done by shifts and adds.
+static unsigned short fade_segend(unsigned char seg)
+{
+    unsigned long end = 0, len = fadelen;
+    unsigned char n = seg + 1;
+
+    for (; n != 0; n >>= 1, len <<= 1) {
+        if (n & 1) end += len;
+    }
+    return end >> FADE_SEG_BITS;
+}
+
+/* Start the next segment with AC cycles in it, from the end of TACCR1_ISR
+ * with interrupts enabled. Sets dimpower from the curve, and its change
+ * per AC cycle for TACCR1_ISR to add until the segment ends. */
+static void fade_segment(void)
+{
+    const unsigned short *c = fadecurves[fadecurve];
+    unsigned short lo = fadefrom, hi = fadetarget, start, len, y, m, r, p;
+    unsigned char seg = fadeseg;
+    signed char sh = 1;
+    unsigned char i;
+
+    // Segments are empty in fades shorter than FADE_SEGS cycles
+    do {
+        start = fade_segend(seg++);
+        len = fade_segend(seg) - start;
+    } while (len == 0);
+    fadeseg = seg;
+    fadeleft = len;
+
+    // Decreasing fades follow the curve backwards from fadetarget
+    if (hi < lo) {
+        lo = fadetarget;
+        hi = fadefrom;
+        seg = FADE_SEGS - 1 - seg;
+    }
+    c += seg;
+    y = mult(hi - lo, c[0]);
+    p = mult(hi - lo, c[1]);
+    dimpower = lo + (fadetarget == hi ? y : p);
+    fadefrac = 0;
+    p -= y;
+
+    /* Length as m * 2^-k with m from 0x8000 to 0xFFFF, which is 0.5 to 1.0
+     * for mult(). r approximates 1 / (2 * m), from 0.5 to 1.0. Start from
+     * below, with the line through 1.0 and 0.5 lowered to touch the curve,
+     * then refine with Newton's method: r += r * (1 - 2 * m * r). That
+     * stays below, and each step squares the relative error, from at most
+     * 17%. Stop early if rounding in mult() gets r to the top. */
+    m = len;
+    while (!(m & 0x8000)) {
+        m <<= 1;
+        sh++;
+    }
+    r = 0x6A08 - m;
+    for (i = 3; i != 0; i--) {
+        unsigned short e = mult(m, r);
+
+        if (e & 0x8000) break;
+        r += mult(r, -(e << 1));
+    }
+
+    /* The change over the segment divided by its length, in 16.16, is
+     * p * r * 2^(1 + k). With p normalized like m, mult() keeps 16
+     * significant bits. It is rounded down, and TACCR1_ISR stops dimpower
+     * at fadetarget, so it can't pass it. */
+    if (p == 0) {
+        fadedec = 0;
+        return;
+    }
+    while (!(p & 0x8000)) {
+        p <<= 1;
+        sh--;
+    }
+    fadedec = mult(p, r);
+    for (; sh > 0; sh--) fadedec <<= 1;
+    for (; sh < 0; sh++) fadedec >>= 1;
+}
+#else // !FADES
+// Without fading, dimpower is set at once
+#define fade_cycles(time) 0
+
+static void fade_start(unsigned short target, unsigned short len,
+                       unsigned char curve)
+{
+    (void)len;
+    if (curve == FADE_NONE) return;
+    dimpower = target;
+    updatedim = true;
+#ifdef POT_DIRECT
+    potdirect = false;
+#endif
+}
+#endif // !FADES
+
+/*** Serial telemetry and commands ***/
+#ifdef SERIAL_BAUD
+/* Half-duplex UART on P1.2, with bits sent and sampled by TACCR0_ISR via
+ * the channel scheduler. A telemetry frame is started in case 6 of
+ * TACCR1_ISR and sent during the following AC cycle, when only short
+ * interrupts can delay bits. Its bytes are read from the variables as they
+ * are sent, so no buffer is needed, and a frame still being sent delays
+ * the next one. The host sends commands one bit time after a frame ends,
+ * while P1.2 is an input with pullup. A fade time is kept as it arrives,
+ * and a dimming command waits in serdim for case 6, so the last one in an
+ * AC cycle is applied. Commands are only checked by their stop bit. Bit
+ * length is derived from the AC period, because the DCO is set above its
+ * calibrated 1 MHz. With TRACE, records are sent from a ring buffer
+ * instead, which has one producer and one consumer, which only write
+ * their own index. */
+
+#define SER_IDLE 0 // Receiving start bit via port 1 interrupt
+#define SER_TX 1   // Sending
+#define SER_RX 2   // Receiving byte
+
+#ifdef TRACE
+static unsigned char sertx[TRACE_SIZE];     // Trace to send
+static unsigned char sertxhead, sertxtail;  // Written by TACCR1, TACCR0 ISR
+static unsigned char serburst;              // Bytes left to send in burst
+#define SER_PENDING() (sertxtail != sertxhead)
+#else
+static unsigned char serbyte = SER_FRAMELEN; // Next byte of frame
+static unsigned char sersum;                // Sum of frame bytes sent
+static unsigned char serhi;                 // High byte of word being sent
+#define SER_PENDING() (serbyte != SER_FRAMELEN)
+#endif
+static unsigned char sermode = SER_IDLE;
+static unsigned short serbit;               // Bit length in timer cycles
+static unsigned short sershift;             // Bits being sent or received
+static unsigned char serbits;               // Bit events left in byte
+static unsigned char serdim = SER_NODIM;    // Dimming command to apply
+#ifdef FADES
+// Fade time for dimming commands, in 1/10 s
+static unsigned char sertime =
+    FADE_TENTHS(FADE_ONOFF_TIME) < SER_VALUE ? FADE_TENTHS(FADE_ONOFF_TIME) :
+                                               SER_VALUE;
+#endif
+static bool serremote;                      // Dimming follows command
+static unsigned short serpot;               // potavg at dimming command
+
+// Start sending, at time t
+static void ser_txstart(unsigned short t)
+{
+    P1IE &= ~P1_SERIAL;
+    P1OUT |= P1_SERIAL;
+    P1DIR |= P1_SERIAL;
+    sermode = SER_TX;
+    serbits = 0;
+    chtime[CH_SERIAL] = t;
+}
+
+// Stop sending or receiving, and wait for start bit
+static void ser_listen(void)
+{
+    P1DIR &= ~P1_SERIAL;
+    P1IFG &= ~P1_SERIAL;
+    P1IE |= P1_SERIAL;
+    sermode = SER_IDLE;
+}
+
+// Start receiving byte, from port 1 ISR at start bit
+static void ser_rxstart(void)
+{
+    P1IE &= ~P1_SERIAL;
+    P1IFG &= ~P1_SERIAL;
+    sermode = SER_RX;
+    serbits = 9;
+    // Sample in the middle of bits
+    chtime[CH_SERIAL] = TAR + serbit + (serbit >> 1);
+    ch_insert(CH_SERIAL);
+    ch_arm();
+}
+
+#ifndef TRACE
+// Telemetry words, after sync and state
+static const unsigned short *const serword[] = {
+    &hperiod, &dimpower, &potavg, &triacdelay[0]
+};
+
+// Next byte of telemetry frame. The high byte of a word is kept when its
+// low byte is read, so an update between them doesn't split the word.
+static unsigned char ser_framebyte(void)
+{
+    unsigned char i = serbyte++, b;
+
+    if (i == 0) {
+        sersum = 0;
+        b = SER_SYNC;
+    } else if (i == 1) {
+        b = state;
+    } else if (i == SER_FRAMELEN - 1) {
+        return sersum;
+    } else if (i & 1) {
+        b = serhi;
+    } else {
+        unsigned short w = *serword[(i - 2) >> 1];
+
+        serhi = w >> 8;
+        b = w;
+    }
+    sersum += b;
+    return b;
+}
+#endif
+
+// Handle serial event due at time t, returning true if another follows
+static bool ser_event(unsigned short t)
+{
+    if (sermode == SER_RX) {
+        if (--serbits == 0) {
+            // Stop bit
+            if (P1IN & P1_SERIAL) {
+                if (!(sershift & SER_CMD_TIME)) {
+                    serdim = sershift;
+                } else {
+#ifdef FADES
+                    sertime = sershift & SER_VALUE;
+#endif
+                }
+            }
+            ser_listen();
+            // Frame may have been started while receiving
+            if (!SER_PENDING()) return false;
+            ser_txstart(t + serbit);
+            return true;
+        }
+        sershift = (sershift >> 1) | ((P1IN & P1_SERIAL) ? 0x80 : 0);
+    } else {
+        if (serbits == 0) {
+            unsigned char b;
+
+            // Previous stop bit done
+            if (!SER_PENDING()) {
+                ser_listen();
+                return false;
+            }
+#ifdef TRACE
+            // Trace is sent in bursts from case 6 of TACCR1_ISR, like
+            // telemetry frames, so bits aren't delayed by it
+            if (serburst == 0) {
+                ser_listen();
+                return false;
+            }
+            serburst--;
+            b = sertx[sertxtail];
+            sertxtail = TRACE_NEXT(sertxtail);
+#else
+            b = ser_framebyte();
+#endif
+            // Start bit, 8 data bits LSB first, stop bit. Time the byte
+            // from now if late, because idle time before it can stretch.
+            if ((short)(TAR - t) > 0) t = TAR;
+            sershift = (b << 1) | 0x200;
+            serbits = 10;
+        }
+        if (sershift & 1) P1OUT |= P1_SERIAL;
+        else P1OUT &= ~P1_SERIAL;
+        sershift >>= 1;
+        serbits--;
+    }
+    chtime[CH_SERIAL] = t + serbit;
+    return true;
+}
+
+// Follow pot again if it moved away from where it was at dimming command
+static bool ser_remote(void)
+{
+    unsigned short potdelta = potavg - serpot + POT_TOLERANCE;
+
+    if (potdelta > 2 * POT_TOLERANCE) serremote = false;
+    return serremote;
+}
+
+// Start sending if idle, once PLL is locked
+static void ser_send(void)
+{
+    if (sermode == SER_IDLE && SER_PENDING()) {
+        // Bit length only changes between bytes
+        serbit = mult(hperiod, MAINS_50HZ(hperiod) ? SER_BITFRAC(50) :
+                                                     SER_BITFRAC(60));
+        ser_txstart(TAR + CH_MINLEAD);
+        ch_insert(CH_SERIAL);
+        ch_arm();
+    }
+}
+
+// Apply dimming command and start telemetry, from case 6 of TACCR1_ISR.
+// Returns true if a fade was started, so the main thread must be woken.
+static bool ser_cycle(void)
+{
+    bool wake = false;
+
+    /*** Apply dimming command ***/
+    if (serdim != SER_NODIM) {
+        unsigned short val = serdim;
+
+        serdim = SER_NODIM;
+        if (state == STATE_ON) {
+            // Fade to value, scaled so 127 is full power
+            serremote = true;
+            serpot = potavg;
+            fade_start((val << 9) | (val << 2) | (val >> 5),
+                       fade_cycles(sertime), FADE_ONOFF_CURVE);
+            wake = true;
+        }
+    }
+
+#ifdef TRACE
+    // Trace is sent instead of telemetry, once bit length is known
+    serburst = SER_FRAMELEN;
+    if (plllock < PLL_LOCKED) return wake;
+#else
+    /*** Start telemetry frame ***/
+    // Bit length isn't known without PLL lock, and a frame still being
+    // sent is finished first
+    if (plllock < PLL_LOCKED || SER_PENDING()) return wake;
+    serbyte = 0;
+#endif
+
+    ser_send();
+    return wake;
+}
+
+#define SER_REMOTE() ser_remote()
+#else
+#define SER_REMOTE() false
+#endif
+
+/*** Trace ***/
+#ifdef TRACE
+/* Records of every zero crossing capture, change of switch and trigger
+ * inputs and pot reading, for replay by Tools/sim. Captures and pot
+ * readings are residuals from a prediction, so an AC cycle normally takes
+ * 3 bytes. Times are TAR values. Inputs sampled in case 6 of TACCR1_ISR
+ * have the time of its compare, so replay can change them just before.
+ * Decoding starts with all predictor state zero, or at a sync record. */
+
+static unsigned short trlast[2];        // Last capture, by edge
+static unsigned short trper[2];         // Interval between last captures
+static unsigned short trpot;            // Last pot reading
+static unsigned char trinput = TRACE_SW_OFF | TRACE_SW_ON | TRACE_TRIGGER;
+static unsigned short trnow;            // Time of case 6 in this AC cycle
+static unsigned char trcycles = TRACE_SYNC_CYCLES; // Until sync record
+static bool trlost;                     // Records lost, until sync record
+static bool trstopped;                  // Timer stopped in LPM4
+#ifdef SERIAL_BAUD
+static bool trflush;                    // Main thread waits for sending
+#else
+// Volatile, as only the debugger reads them
+static volatile unsigned char tracebuf[TRACE_SIZE]; // Ring
+static unsigned char tracehead;         // Next byte written
+static volatile unsigned char tracesync; // Start of last sync record
+#endif
+
+// Words of sync record, after the inputs
+static const unsigned short *const trsyncword[] = {
+    &trlast[0], &trper[0], &trlast[1], &trper[1], &trpot
+};
+
+// Append record, or note loss if there is no room
+static void trace_write(const unsigned char *p, unsigned char n)
+{
+#ifdef SERIAL_BAUD
+    unsigned char h = sertxhead;
+    short room = sertxtail - h - 1;
+
+    if (room < 0) room += TRACE_SIZE;
+    if (room < n) {
+        trlost = true;
+        return;
+    }
+    while (n-- > 0) {
+        sertx[h] = *p++;
+        h = TRACE_NEXT(h);
+    }
+    sertxhead = h;
+#else
+    while (n-- > 0) {
+        tracebuf[tracehead] = *p++;
+        tracehead = TRACE_NEXT(tracehead);
+    }
+#endif
+}
+
+// Append value as residual from prediction, in units of 1 << shift
+static void trace_value(unsigned char tag, unsigned short val,
+                        unsigned short pred, unsigned char shift)
+{
+    unsigned char rec[3];
+    short r = val - pred;
+
+    if (trlost) return;
+    if ((r & ((1 << shift) - 1)) != 0) {
+        // Not in residual units
+    } else if ((r >>= shift) >= -16 && r < 16) {
+        rec[0] = tag | (r & 0x1F);
+        trace_write(rec, 1);
+        return;
+    } else if (r >= -2048 && r < 2048) {
+        rec[0] = tag | TRACE_MID | ((r >> 8) & 0x0F);
+        rec[1] = r;
+        trace_write(rec, 2);
+        return;
+    }
+    rec[0] = tag | TRACE_ABS;
+    rec[1] = val;
+    rec[2] = val >> 8;
+    trace_write(rec, 3);
+}
+
+// Append capture at time t, predicted one interval after the last
+static void trace_capture(unsigned char edge, unsigned short t)
+{
+    unsigned short pred = trlast[edge] + trper[edge];
+
+    trper[edge] = t - trlast[edge];
+    trlast[edge] = t;
+    trace_value(edge ? TRACE_RISE : TRACE_FALL, t, pred, 0);
+}
+
+// Append pot reading, predicted to be unchanged
+static void trace_pot(unsigned short val)
+{
+    unsigned short pred = trpot;
+
+    trpot = val;
+    trace_value(TRACE_ADC, val, pred, TRACE_POTSHIFT);
+}
+
+// Append P1IN inputs sampled at time t, if changed or woken from LPM4
+static void trace_input(unsigned char in, unsigned short t)
+{
+    unsigned char rec[3], woken = trstopped ? TRACE_WOKEN : 0;
+
+    trstopped = false;
+    in = ((in & P1_SW_OFF) ? TRACE_SW_OFF : 0) |
+         ((in & P1_SW_ON) ? TRACE_SW_ON : 0) |
+         ((in & P1_TRIGGER) ? TRACE_TRIGGER : 0);
+    if (in == trinput && !woken) return;
+    trinput = in;
+    if (trlost) return;
+    rec[0] = TRACE_IN | woken | in;
+    rec[1] = t;
+    rec[2] = t >> 8;
+    trace_write(rec, 3);
+}
+
+// Start of case 6 of TACCR1_ISR, with time t of its compare
+static void trace_cycle(unsigned short t)
+{
+    trnow = t;
+    if (trlost || --trcycles == 0) {
+        unsigned char rec[TRACE_SYNCLEN];
+        unsigned char i;
+#ifndef SERIAL_BAUD
+        unsigned char h = tracehead;
+#endif
+
+        rec[0] = TRACE_IN | TRACE_SYNC | (trlost ? TRACE_LOST : 0) |
+                 trinput;
+        for (i = 0; i < 5; i++) {
+            unsigned short w = *trsyncword[i];
+
+            rec[2 * i + 1] = w;
+            rec[2 * i + 2] = w >> 8;
+        }
+        trlost = false;
+        trace_write(rec, TRACE_SYNCLEN);
+#ifndef SERIAL_BAUD
+        tracesync = h;
+#endif
+        trcycles = TRACE_SYNC_CYCLES;
+    }
+}
+
+#define TRACE_CAPTURE(edge, t) trace_capture(edge, t)
+#define TRACE_POT(val) trace_pot(val)
+#define TRACE_INPUT(in, t) trace_input(in, t)
+#define TRACE_CYCLE(t) trace_cycle(t)
+#define TRACE_STOP() (trstopped = true)
+#else
+#define TRACE_CAPTURE(edge, t)
+#define TRACE_POT(val)
+#define TRACE_INPUT(in, t)
+#define TRACE_CYCLE(t)
+#define TRACE_STOP()
+#endif
+
+/*** Pot sampling ***/
+
+// Start reading pot, from TACCR1_ISR
+static void pot_start(void)
+{
+#if POT_OVERSAMPLE
+    // Writing the start address starts the DTC
+    ADC10SA = (unsigned short)(uintptr_t)potbuf;
+#endif
+    ADC10CTL0 = ADC10CTL0_VAL | (ENC | ADC10SC);
+}
+
+#if POT_OVERSAMPLE
+// ADC10_ISR clears ADC10IE when potbuf is filled
+#define POT_READY() (!(ADC10CTL0 & ADC10IE))
+
+// Read pot as 16 bit value, discarding highest and lowest samples
+static unsigned short pot_read(void)
+{
+    unsigned short sum = 0, lo = 0x3FF, hi = 0;
+    unsigned char i;
+
+    for (i = 0; i < POT_SAMPLES; i++) {
+        register unsigned short v = potbuf[i];
+
+        sum += v;
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+    }
+    // Sum may wrap, but the result fits
+    return (sum - lo - hi) << (6 - POT_OVERSAMPLE);
+}
+#else
+#define POT_READY() (ADC10CTL0 & ADC10IFG)
+#define pot_read() (ADC10MEM << 6)
+#endif
 
 /*** State descriptors ***/
 
-// Map from state to dimming target value
-static const unsigned s2dimtarg[] = { 0, 0, TRIGDIMTARGET, 0 };
-// Map from state to dimming step
-static const unsigned short s2dimstep[] = { 0xFFFF-DIMSPEED+1,
-                                            0,
-                                            1,
-                                            DIMSPEED };
+// Map from state to fade target value
+static const unsigned short s2fadetarg[] = { 0, 0, TRIGDIMTARGET, 0 };
+// Map from state to fade time
+static const unsigned short s2fadetime[] = { FADE_TENTHS(FADE_ONOFF_TIME),
+                                             0,
+                                             FADE_TENTHS(FADE_TRIG_TIME),
+                                             0 };
+// Map from state to fade curve. When on, fade starts after pot is read.
+static const unsigned char s2fadecurve[] = { FADE_ONOFF_CURVE,
+                                             FADE_NONE,
+                                             FADE_TRIG_CURVE,
+                                             FADE_NONE };
 // Map from state to which port 1 interupts are enabled
 static const unsigned char s2p1ie[] = { P1_SW_ON | P1_SW_OFF,
                                         P1_SW_ON | P1_SW_OFF | P1_TRIGGER,
@@ -95,13 +1795,524 @@ static const unsigned char s2p1ies[] = { P1_SW_ON,
                                          P1_SW_OFF | P1_SW_ON,
                                          P1_SW_OFF };
 
+/*** Dimming conversion ***/
+/* Convert dimpower to triacdelay, from the end of TACCR1_ISR. Only
+ * TACCR1_ISR changes dimpower and hperiod, so they are stable here.
+ * Don't inadvertently turn on TRIAC after main thread turned it off. */
+static void dim_convert(void)
+{
+    unsigned short hdelta;
+    unsigned char ch;
+
+    updatedim = false;
+    if (state <= STATE_TRIGWAIT && curdimpower == 0) return;
+
+    // Reuse triacdelay if nothing changed beyond tolerance
+    hdelta = hperiod - delayhperiod + HPERIOD_TOLERANCE;
+    if (dimpower == curdimpower && hdelta <= 2 * HPERIOD_TOLERANCE) {
+        UPDSTAT(convskip);
+        return;
+    }
+    curdimpower = dimpower;
+#ifndef BURST_FIRE
+#ifdef ENERGY_METER
+    meterpower = meter_power(curdimpower);
+#endif
+    if (delayhperiod != hperiod) {
+        // Slots kept by the conversions were scaled by the old half-period
+        dimtab_cslot = DIMTAB_NOSLOT;
+#ifdef POT_DIRECT
+        pottab_cslot = POTTAB_NOSLOT;
+#endif
+    }
+#endif
+    delayhperiod = hperiod;
+    // Look up angle scaled to current period
+    for (ch = 0; ch < CHANNELS; ch++) {
+        unsigned short chdim = curdimpower;
+
+#ifdef POT_DIRECT
+        // Following pot, so convert averaged pot value directly
+        if (ch == 0 && potdirect && chscale[0] == 0xFFFF) {
+            triacdelay[0] = potdelay(potdim, delayhperiod);
+            continue;
+        }
+#endif
+        if (chscale[ch] != 0xFFFF) {
+            chdim = mult(curdimpower, chscale[ch]);
+        }
+#ifdef BURST_FIRE
+        burstpower[ch] = chdim;
+#else
+        triacdelay[ch] = dimdelay(chdim, delayhperiod);
+#endif
+    }
+}
+
+/*** Periodic work scheduling ***/
+/* Work in case 6 of TACCR1_ISR must end before the next falling optocoupler
+ * edge, or its capture would be handled late. Zero crossing tracking,
+ * firing, fading and serial run every cycle. Pot reading and debouncing
+ * can wait, so each is deferred a cycle if its estimated run time doesn't
+ * fit in what remains, keeping time for converting dimpower at the end.
+ * A task deferred in the last cycle runs regardless, so it is never
+ * delayed by more than a cycle. */
+
+#ifdef WORK_STATS
+static struct {
+    unsigned short overruns;    // Work ending after end
+    unsigned short deferrals;   // Tasks deferred to the next cycle
+    unsigned short end;         // Time work must end by, in this cycle
+} workstats;                    // Saturating, for reading via debugger
+
+// Saturating increment of workstats counter
+#define WORKSTAT(x) do { if (workstats.x != 0xFFFF) workstats.x++; } while (0)
+#else
+#define WORKSTAT(x)
+#endif
+
+// Time case 6 work must end by, with time t of its compare and time fall
+// of the last falling edge
+static unsigned short work_start(unsigned short t, unsigned short fall)
+{
+    unsigned short period = hperiod << 1;
+    unsigned short end = fall + period - (hperiod >> WORK_MARGIN_SHIFT);
+
+    // Deadline already passed
+    if ((unsigned short)(end - t) > period) end = t;
+#ifdef WORK_STATS
+    workstats.end = end;
+#endif
+    return end;
+}
+
+// Whether deferrable task, taking cost timer cycles, runs in this cycle
+// with work ending by end
+static bool task_run(unsigned short end, unsigned char task,
+                     unsigned short cost)
+{
+    // Time left, or more than a period once past end
+    unsigned short left = end - TAR;
+
+    cost += MCLK_TICKS(CONVERT_COST);
+    if ((taskdeferred & task) == 0 &&
+        (left > (hperiod << 1) || left < cost)) {
+        taskdeferred |= task;
+        WORKSTAT(deferrals);
+        return false;
+    }
+    taskdeferred &= ~task;
+    return true;
+}
+
+// End of case 6 work, after converting dimpower
+static void work_end(void)
+{
+#ifdef WORK_STATS
+    if ((unsigned short)(workstats.end - TAR) > (hperiod << 1)) {
+        WORKSTAT(overruns);
+    }
+#endif
+}
+
+/*** Periodic work, from case 6 of TACCR1_ISR ***/
+/* The next falling edge is in the next half cycle, and task_run() defers
+ * what can wait if it might not fit. This is a function of its own, so the
+ * registers it needs are only saved on the stack while it runs, and not
+ * under interrupts nesting in the dimpower conversion at the end of
+ * TACCR1_ISR. t1 is the time of the falling edge, and TACCR1 that of the
+ * rising edge plus its debounce delay. Returns whether to wake the main
+ * thread. */
+#pragma inline=never
+static bool zc_cycle(unsigned short t1)
+{
+    static unsigned char pllbad;
+    static bool adc10start;
+    unsigned short t2 = TACCR1 - (hperiod >> ZC_RISE_SHIFT);
+    unsigned short end = work_start(TACCR1, t1);
+    bool wake = false;
+
+    /*** Track peak time and period with PLL ***/
+    t2 -= t1; // Length of optocoupler activation
+    t1 += t2 >> 1; // Time of peak
+#ifdef LPM3_IDLE
+    {
+        unsigned short h = (t2 + (1 << ZCHALF_SHIFT)) >> (ZCHALF_SHIFT + 1);
+
+        zchalf = h > 0xFF ? 0xFF : h;
+    }
+    // Checking wake time needs TAR not to wrap
+    idlerefok = false;
+#endif
+    {
+        unsigned char coast = 0;
+        short err, window;
+        // Time since last prediction, which can be too long for a
+        // signed difference after missed pulses
+        unsigned short since = t1 - (unsigned short)(pllphase >> 16);
+
+        // Predict this peak, coasting over cycles with no pulse
+        pllphase += pllperiod;
+        while (since > (unsigned short)(pllperiod >> 16) +
+                       (unsigned short)(pllperiod >> 17) &&
+               coast++ < PLL_MAXCOAST) {
+            pllphase += pllperiod;
+            since -= (unsigned short)(pllperiod >> 16);
+        }
+        err = t1 - (unsigned short)(pllphase >> 16);
+        // Prediction already moved on for a spurious pulse
+        if (err < -(short)(pllperiod >> 17)) {
+            pllphase -= pllperiod;
+            err = t1 - (unsigned short)(pllphase >> 16);
+        }
+
+        window = pllperiod >> (16 + (plllock >= PLL_LOCKED ?
+                                     PLL_WINDOW_SHIFT :
+                                     PLL_WINDOW_SHIFT_FAST));
+        if (!pllstart && err <= window && err >= -window) {
+            // Good cycle, so correct phase and frequency. Gains
+            // are shifts, so no 32 bit multiply is needed.
+            unsigned long e = (long)err;
+
+            if (plllock >= PLL_LOCKED) {
+                pllphase += e << (16 - PLL_KP);
+                pllperiod += e << (16 - PLL_KI);
+            } else {
+                pllphase += e << (16 - PLL_KP_FAST);
+                pllperiod += e << (16 - PLL_KI_FAST);
+                plllock++;
+            }
+            pllbad = 0;
+        } else if (pllstart || plllock < PLL_LOCKED ||
+                   ++pllbad >= PLL_MAXBAD) {
+            // Not locked, lock lost or detection just started, so
+            // restart from this cycle. The peak from before
+            // detection started is stale, so use the saved period.
+            pllphase = (unsigned long)t1 << 16;
+            if (!pllstart) {
+                pllperiod = (unsigned long)(unsigned short)(t1 - pllpeak)
+                            << 16;
+            } else {
+                unsigned short saved = pll_saved();
+
+                if (saved != 0) pllperiod = (unsigned long)saved << 16;
+            }
+            pllstart = false;
+            plllock = 0;
+            pllbad = 0;
+        } // else locked, so ignore spurious pulse and coast
+        pllpeak = t1;
+    }
+
+    /*** Calculate half-period and zero crossing time ***/
+    hperiod = (pllperiod + 0x10000) >> 17; // Half-cycle length
+    // Restarted PLL can have any period until the next cycle, so
+    // limit it for timing windows and dimming conversion
+    if (hperiod < HPERIOD_MIN) hperiod = HPERIOD_MIN;
+    if (hperiod > HPERIOD_MAX) hperiod = HPERIOD_MAX;
+    t2 = hperiod >> 1; // Quarter-cycle length
+    t1 = (unsigned short)(pllphase >> 16) + t2; // Previous zero cross
+
+#ifdef BURST_FIRE
+    /*** Decide whether next AC cycle is on ***/
+    /* First-order sigma-delta modulation: a cycle is on when the
+     * accumulator carries, so cycles are spread out evenly. Cycles
+     * that are on get triacdelay BURST_DELAY. A burst is fired at
+     * the zero crossing after this one, which begins the positive
+     * half-cycle, and TACCR0_ISR then holds the gate until a cycle
+     * is off. That is released here, in the negative half-cycle,
+     * when the TRIAC is already conducting until the cycle ends.
+     * Bursts are thus always whole cycles, with one timer event
+     * each. */
+    {
+        unsigned char ch;
+        bool rearm = false;
+
+        if (burstpower[0] > 0) P1OUT |= P1_LED;
+
+        for (ch = 0; ch < CHANNELS; ch++) {
+            unsigned char bit = chbit[ch];
+            unsigned short acc = burstacc[ch];
+
+            burstacc[ch] += burstpower[ch];
+            if (burstacc[ch] < acc) {
+                triacdelay[ch] = BURST_DELAY;
+                // Already held or firing, so the burst goes on
+                if ((chhold | chqueued) & bit) continue;
+                chzc[ch] = t1 + hperiod;
+                chtime[ch] = chzc[ch] + BURST_DELAY;
+                ch_insert(ch);
+            } else {
+                triacdelay[ch] = 0;
+                if (((chhold | chqueued) & bit) == 0) continue;
+                ch_remove(ch);
+                chhold &= ~bit;
+                P2OUT &= ~(bit & P2_TRIACS);
+            }
+            rearm = true;
+        }
+        // Also sets TA0.0 output from chhold
+        if (rearm) ch_arm();
+    }
+#else
+
+    // Update zero crossing times if needed
+    {
+        unsigned short delta;
+        unsigned char ch;
+        bool rearm = false;
+
+        if (triacdelay[0] > 0) {
+            /* Turn on indicator LED so it truly indicates TRIAC is
+             * active. This will indicate if any bug is wasting
+             * power by keeping the lamp on at very low levels. */
+            P1OUT |= P1_LED;
+
+            // Convert again if triacdelay is for an old half-period
+            delta = hperiod - delayhperiod + HPERIOD_TOLERANCE;
+            if (delta > 2 * HPERIOD_TOLERANCE && !updatedim) {
+                updatedim = true;
+                UPDSTAT(hwake);
+            }
+        }
+
+        for (ch = 0; ch < CHANNELS; ch++) {
+            if (triacdelay[ch] == 0) continue;
+
+            delta = chzc[ch] - t1;
+            chzc[ch] = t1;
+            if (delta > t2) delta = -delta;
+            if ((delta > t2 || (chqueued & chbit[ch]) == 0) &&
+                (chhold & chbit[ch]) == 0) {
+                /* This is used in two cases:
+                 * - Dimming ISR already set up next firing based on
+                 *   old zero crossing time. Update it based on new
+                 *   time.
+                 * - Channel is not scheduled. It is scheduled. */
+                chzc[ch] += hperiod;
+                chtime[ch] = chzc[ch] + triacdelay[ch];
+                ch_remove(ch);
+                ch_insert(ch);
+                rearm = true;
+            }
+        }
+        if (rearm) ch_arm();
+    }
+#endif // BURST_FIRE
+
+#ifdef ENERGY_METER
+    /*** Energy metering ***/
+    meter_cycle();
+#endif
+
+    /*** Update dimming ***/
+    // Before deferrable tasks, so they are only run if time is
+    // left after it. A fade started by them begins next cycle.
+#ifdef FADES
+    if (fading && fadeleft != 0) {
+        register unsigned short newpower = dimpower;
+
+        if (--fadeleft != 0) {
+            // Within segment, step towards target without passing it
+            unsigned long pos = (unsigned long)dimpower << 16 |
+                                fadefrac;
+            unsigned long end = (unsigned long)fadetarget << 16;
+
+            if (fadetarget < fadefrom) {
+                pos = pos - end > fadedec ? pos - fadedec : end;
+            } else {
+                pos = end - pos > fadedec ? pos + fadedec : end;
+            }
+            newpower = (unsigned short)(pos >> 16);
+            fadefrac = (unsigned short)pos;
+        } else if (fadeseg == FADE_SEGS - 1) {
+            // Fade ends exactly at target
+            newpower = fadetarget;
+            fadecurve = FADE_NONE;
+        } else {
+            // End of this ISR starts the next segment
+            updatedim = true;
+        }
+
+        if (newpower != dimpower) {
+            dimpower = newpower;
+            updatedim = true;
+        }
+    } // if (fading && fadeleft != 0)
+#endif
+
+    /*** Read ADC ***/
+    // Done before input debouncing so first reading after ADC
+    // power-up is delayed by one AC cycle
+    if (state == STATE_ON &&
+        task_run(end, TASK_POT, MCLK_TICKS(TASK_POT_COST))) {
+        if (POT_READY()) {
+            unsigned short adjustedavg, val = pot_read();
+
+            TRACE_POT(val);
+            if (adc10start) {
+                // First value not averaged
+                potavg = val;
+            } else {
+                // Average with old values, for example with
+                // POT_FILTER 3, potavg = 7/8*potavg + 1/8*val
+                potavg = potavg - (potavg >> POT_FILTER) +
+                         (val >> POT_FILTER);
+            } // else !adcstart
+
+            // Start new conversion
+            pot_start();
+
+            // Ensure that 0xFFFF can be reached
+            adjustedavg = potavg + POT_OFFSET;
+            if (adjustedavg < potavg) adjustedavg = 0xFFFF;
+
+            if (SER_REMOTE()) {
+                // Following serial command instead of pot
+            } else if (adc10start) {
+                // First value, so fade from where state change left
+                fade_start(adjustedavg,
+                           fade_cycles(FADE_TENTHS(FADE_ONOFF_TIME)),
+                           FADE_ONOFF_CURVE);
+#ifdef FADES
+            } else if (fading) {
+                // Still fading, so fade from here to the pot if
+                // it moved noticeably. Moving only the target
+                // could take it past fadefrom and turn the fade.
+                unsigned short potdelta = adjustedavg - fadetarget +
+                                          POT_TOLERANCE;
+
+                if (potdelta > 2 * POT_TOLERANCE) {
+                    fade_start(adjustedavg, fadelen, fadecurve);
+                }
+#endif
+            } else {
+                // Simply following pot, if it moved noticeably
+                unsigned short potdelta = adjustedavg - dimpower +
+                                          POT_TOLERANCE;
+
+                if (potdelta > 2 * POT_TOLERANCE) {
+                    updatedim = true;
+                    dimpower = adjustedavg;
+#ifdef POT_DIRECT
+                    potdim = potavg;
+                    potdirect = true;
+#endif
+                }
+            } // else !fading
+            adc10start = false;
+        } else {
+            // Start first conversion here after settling
+            pot_start();
+        } // else !POT_READY()
+    } // state == STATE_ON
+
+    /*** Debounce input ***/
+    if (debctr > 0 &&
+        task_run(end, TASK_DEBOUNCE, MCLK_TICKS(TASK_DEBOUNCE_COST))) {
+        register unsigned char newinput = P1IN;
+        unsigned char p1inmask = P1_SW_ON | P1_SW_OFF;
+
+        TRACE_INPUT(newinput, trnow);
+        if ((newinput & (P1_SW_ON | P1_SW_OFF)) ==
+            (P1_SW_ON | P1_SW_OFF) && state != STATE_TRIGGERED) {
+              // Only care about trigger when it can have an effect
+              p1inmask |= P1_TRIGGER;
+        }
+        newinput &= p1inmask;
+
+        if (newinput == inputval) {
+            if (--debctr == 0) {
+                // Debounce counter expired
+                unsigned char nextstate;
+
+                // Figure out new state based on inputs
+                if ((newinput & P1_SW_OFF) == 0) {
+                    nextstate = STATE_OFF;
+                } else if ((newinput & P1_SW_ON) == 0) {
+                    nextstate = STATE_ON;
+                } else if (state == STATE_TRIGWAIT &&
+                           (newinput & P1_TRIGGER) == 0) {
+                    nextstate = STATE_TRIGGERED;
+                } else {
+                    nextstate = STATE_TRIGWAIT;
+                }
+
+                // Enable interrupts to detect leaving of new state
+                P1IFG &= P1_KEEP;
+                P1IES = (P1IES & P1_KEEP) | s2p1ies[nextstate];
+                P1IE = (P1IE & P1_KEEP) | s2p1ie[nextstate];
+
+                // Re-verify, because P1IN change before interrupt
+                // enabling would have been missed
+                if ((P1IN & p1inmask) == newinput) {
+                    // Debouncing finally done
+
+                    if (state != nextstate) {
+                        // Set up ADC10 for new state
+                        ADC10CTL0 = 0; // Ensure ENC=0
+                        if (nextstate == STATE_ON) {
+                            ADC10CTL0 = ADC10CTL0_VAL;
+                            ADC10CTL1 = ADC10CTL1_VAL;
+                            adc10start = true;
+                        } else {
+                            // ADC10 not needed
+                            ADC10CTL0 = 0;
+                            adc10start = false;
+                        }
+
+                        // Transition to new state
+                        state = nextstate;
+                        fade_start(s2fadetarg[nextstate],
+                                   fade_cycles(s2fadetime[nextstate]),
+                                   s2fadecurve[nextstate]);
+#ifdef SERIAL_BAUD
+                        serremote = false;
+#endif
+                    }
+
+                    // Main thread will return to LPM4 when
+                    // appropriate. Set triacdelay to enable TRIAC
+                    // driver.
+                    updatedim = true;
+                    wake = true;
+                } else { // (P1IN & p1inmask) != newinput
+                    // Failure, keep debouncing
+                    P1IE &= P1_KEEP;
+                    debctr = DEBOUNCE_LEN;
+                }
+            } // if (--debctr == 0)
+        } else { // newinput != inputval
+            // Still bouncing
+            debctr = DEBOUNCE_LEN;
+            inputval = newinput;
+        }
+    }
+
+    // Would have converted to follow pot without POT_TOLERANCE
+    if (!updatedim && state == STATE_ON && !fading && !adc10start) {
+        UPDSTAT(wakeskip);
+    }
+
+#ifdef SERIAL_BAUD
+    /*** Serial commands and telemetry ***/
+    // Last, so the frame starts when this ISR is about to return
+    if (ser_cycle()) wake = true;
+#endif
+    return wake;
+} // zc_cycle()
+
+
 /*** TACCR1 ISR, for zero crossing detection and other periodic work ***/
 #pragma vector = TIMERA1_VECTOR
 __interrupt void TACCR1_ISR(void)
 {
-    static unsigned short t1, t2;
-    static unsigned short peak;
-    static bool adc10start;
+    static unsigned short t1;
+    bool work = false;
+    PROF_ENTRY();
+#ifdef ISR_PROFILE
+    unsigned char profidx = PROF_CCR1 + (zcmode >> 1);
+#endif
 
     (void)TAIV; // Clear interrupt
 
@@ -109,196 +2320,40 @@ __interrupt void TACCR1_ISR(void)
     switch (__even_in_range(zcmode, 6)) {
     case 0: // Falling edge detected
             t1 = TACCR1;
+            TRACE_CAPTURE(0, t1);
             // Set up debounce delay
-            TACCR1 = t1 + 1000;
+            TACCR1 = t1 + (hperiod >> ZC_FALL_SHIFT);
             TACCTL1 = CCIE;
             break;
     case 2: // End of falling edge debounce delay
+            if (P1IN & P1_ZEROCROSS) {
+                /* Optocoupler is off again, so the edge was a spurious
+                 * pulse or bounce after a rising edge. Wait for another
+                 * falling edge. Otherwise detection could stay locked onto
+                 * bounce, with pulses inverted. For replay, the trace
+                 * shows the pin as having risen before now. */
+                TRACE_CAPTURE(1, TACCR1 - 1);
+                TACCTL1 = CM_2 | ZC_CCTL;
+                zcmode = 0xFE;
+                break;
+            }
             // Prepare for rising edge
             TACCTL1 = CM_1 | ZC_CCTL;
             break;
     case 4: // Rising edge detected
-            t2 = TACCR1;
+            TRACE_CAPTURE(1, TACCR1);
             // Set up debounce delay
             // Must be long enough to end in the next half cycle
-            TACCR1 = t2 + 4000;
+            TACCR1 += hperiod >> ZC_RISE_SHIFT;
             TACCTL1 = CCIE;
             break;
     case 6: // End of rising edge debounce delay
             // Prepare for falling edge
             TACCTL1 = CM_2 | ZC_CCTL;
-
-            /* Other periodic work can happen here because time is available.
-             * The next falling edge is in the next half cycle. */
-
-            /*** Calculate half-period and zero crossing time ***/
-            t2 -= t1; // Length of optocoupler activation
-            t1 += t2 >> 1; // Time of peak
-            hperiod = (t1 - peak) >> 1; // Half-cycle length
-            peak = t1;
-            t2 = hperiod >> 1; // Quarter-cycle length
-            t1 += t2; // Time of previous zero crossing
-
-            // Update zero crossing time if needed
-            if (triacdelay > 0) {
-                unsigned short delta;
-
-                /* Turn on indicator LED so it truly indicates TRIAC is active.
-                 * This will indicate if any bug is wasting power by
-                 * keeping the lamp on at very low levels. */
-                P1OUT |= P1_LED;
-
-                delta = zerocross - t1;
-                zerocross = t1;
-                if (delta > t2) delta = -delta;
-                if (delta > t2 || (TACCTL0&CCIE) == 0) {
-                    /* This is used in two cases:
-                     * - Dimming ISR already set up next interrupt based on
-                     *   old zero crossing time. Update it based on new time.
-                     * - TRIAC interrupt is disabled. It is enabled. */
-                    zerocross += hperiod;
-                    TACCR0 = zerocross + triacdelay;
-                    TACCTL0 = OUTMOD_1 | CCIE;
-                }
-            }
-
-            /*** Read ADC ***/
-            // Done before input debouncing so first reading after ADC
-            // power-up is delayed by one AC cycle
-            if (state == STATE_ON) {
-                if (ADC10CTL0 & ADC10IFG) {
-                    unsigned short adjustedavg;
-
-                    if (adc10start) {
-                        // First value not averaged
-                        potavg = ADC10MEM << 6;
-                        adc10start = false;
-                    } else {
-                        // Read value, and average with old values
-                        // potavg = 7/8*potavg + 1/8*adc;
-                        // ADC is 10 bits and this results in a 16 bit value
-                        potavg = potavg - (potavg >> 3) + (ADC10MEM << 3);
-                    } // else !adcstart
-
-                    // Start new conversion
-                    ADC10CTL0 = ADC10CTL0_VAL | (ENC | ADC10SC);
-
-                    // Ensure that 0xFFFF can be reached
-                    adjustedavg = potavg + 1500;
-                    if (adjustedavg < potavg) adjustedavg = 0xFFFF;
-
-                    if (dimdelta != 0) {
-                        // Still fading, so pot becomes target
-                        dimtarget = adjustedavg;
-                    } else {
-                        // Simply following pot
-                        updatedim = true;
-                        dimpower = adjustedavg;
-                    } // else dimdelta == 0
-                } else {
-                    // Start first conversion here after settling
-                    ADC10CTL0 = ADC10CTL0_VAL | (ENC | ADC10SC);
-                } // else (ADC10CTL0 & ADC10IFG) == 0
-            } // state == STATE_ON
-
-            /*** Debounce input ***/
-            if (debctr > 0) {
-                register unsigned char newinput = P1IN;
-                unsigned char p1inmask = P1_SW_ON | P1_SW_OFF;
-
-                if ((newinput & (P1_SW_ON | P1_SW_OFF)) ==
-                    (P1_SW_ON | P1_SW_OFF) && state != STATE_TRIGGERED) {
-                      // Only care about trigger when it can have an effect
-                      p1inmask |= P1_TRIGGER;
-                }
-                newinput &= p1inmask;
-
-                if (newinput == inputval) {
-                    if (--debctr == 0) {
-                        // Debounce counter expired
-                        unsigned char nextstate;
-
-                        // Figure out new state based on inputs
-                        if ((newinput & P1_SW_OFF) == 0) {
-                            nextstate = STATE_OFF;
-                        } else if ((newinput & P1_SW_ON) == 0) {
-                            nextstate = STATE_ON;
-                        } else if (state == STATE_TRIGWAIT &&
-                                   (newinput & P1_TRIGGER) == 0) {
-                            nextstate = STATE_TRIGGERED;
-                        } else {
-                            nextstate = STATE_TRIGWAIT;
-                        }
-
-                        // Enable interrupts to detect leaving of new state
-                        P1IFG = 0;
-                        P1IES = s2p1ies[nextstate];
-                        P1IE = s2p1ie[nextstate];
-
-                        // Re-verify, because P1IN change before interrupt
-                        // enabling would have been missed
-                        if ((P1IN & p1inmask) == newinput) {
-                            // Debouncing finally done
-
-                            if (state != nextstate) {
-                                // Set up ADC10 for new state
-                                ADC10CTL0 = 0; // Ensure ENC=0
-                                if (nextstate == STATE_ON) {
-                                    ADC10CTL0 = ADC10CTL0_VAL;
-                                    ADC10CTL1 = ADC10CTL1_VAL;
-                                    adc10start = true;
-                                } else {
-                                    // ADC10 not needed
-                                    ADC10CTL0 = 0;
-                                    adc10start = false;
-                                }
-
-                                // Transition to new state
-                                state = nextstate;
-                                dimtarget = s2dimtarg[nextstate];
-                                dimdelta = s2dimstep[nextstate];
-                            }
-
-                            // Main thread will, when appropriate
-                            // - return to LPM4
-                            // - set triacdelay to enable TRIAC driver
-                            __bic_SR_register_on_exit(LPM4_bits);
-                        } else { // (P1IN & p1inmask) != newinput
-                            // Failure, keep debouncing
-                            P1IE = 0;
-                            debctr = DEBOUNCE_LEN;
-                        }
-                    } // if (--debctr == 0)
-                } else { // newinput != inputval
-                    // Still bouncing
-                    debctr = DEBOUNCE_LEN;
-                    inputval = newinput;
-                }
-            }
-
-            /*** Update dimming ***/
-            if (dimdelta != 0 && !adc10start) {
-                register unsigned short newpower = dimpower + dimdelta;
-
-                if ((dimdelta >= 0x8000) ?
-                      // Decreasing
-                     (newpower > dimpower || newpower < dimtarget)
-                    : // Increasing
-                     (newpower < dimpower || newpower > dimtarget)) {
-                        // End of fade
-                        newpower = dimtarget;
-                        dimdelta = 0;
-                }
-
-                dimpower = newpower;
-                updatedim = true;
-            } // if (dimdelta != 0 && !adc10start)
-
-            /*** Wake main thread ***/
-            // Use of updatedim ensures that last fade value is actually set
-            if (updatedim) {
-                __bic_SR_register_on_exit(LPM4_bits);
-            }
+            // TACCR1 still has compare time until the next capture
+            TRACE_CYCLE(TACCR1);
+            work = true;
+            if (zc_cycle(t1)) __bic_SR_register_on_exit(LPM4_bits);
 
             /*** Back to mode 0 ***/
             zcmode = 0xFE;
@@ -306,126 +2361,247 @@ __interrupt void TACCR1_ISR(void)
     } // switch (__even_in_range(zcmode, 6)) {
 
     zcmode += 2;
+
+    /*** Convert dimpower to triacdelay ***/
+    /* Done last, with interrupts enabled, so the mult() calls don't delay
+     * TRIAC firings and serial bits. Capture of the next falling edge is
+     * half a cycle away. No interrupt that can nest here wakes the main
+     * thread, which would be lost. It is only woken to turn everything
+     * off once dark. */
+    if (updatedim) {
+        __enable_interrupt();
+#ifdef FADES
+        if (fading && fadeleft == 0) fade_segment();
+#endif
+        dim_convert();
+        if (state <= STATE_TRIGWAIT && curdimpower == 0) {
+            __bic_SR_register_on_exit(LPM4_bits);
+        }
+    }
+    if (work) work_end();
+#ifdef LPM3_IDLE
+    __disable_interrupt();
+    idle_start();
+#endif
+    PROF_EXIT(profidx);
 } // TACCR1_ISR
 
 /*** TACCR0 ISR, for TRIAC triggering ***/
 #pragma vector = TIMERA0_VECTOR
 __interrupt void TACCR0_ISR(void)
 {
-    static bool delayoff = false;
+    unsigned short hold = hperiod >> GATE_HOLD_SHIFT;
+    PROF_ENTRY();
+
+#ifdef LPM3_IDLE
+    if (idlemode == IDLE_SLEEP) {
+        // Woken a margin before the next event, or after IDLE_MAX periods,
+        // when idle can start again
+        idle_wake(0);
+        ch_arm();
+        idle_start();
+        __bic_SR_register_on_exit(SCG1 | SCG0);
+        return;
+    }
+    if (idlemode != IDLE_OFF) {
+        if (idle_edge((__get_SR_register_on_exit() & CPUOFF) != 0)) {
+            __bis_SR_register_on_exit(SCG1 | SCG0);
+        }
+        return;
+    }
+#endif
 
-    if (triacdelay > 1000 || delayoff) {
-        // Set up next
-        zerocross += hperiod;
-        TACCR0 = zerocross + triacdelay;
+#ifdef ISR_PROFILE
+    {
+        unsigned short lat = profentry - TACCR0;
+        unsigned short bin = lat >> PROF_BINSHIFT;
 
-        TACCTL0 = OUTMOD_0 | CCIE; // Turn off TRIAC driver
-        TACCTL0 = OUTMOD_1 | CCIE; // Enable for next cycle
+        if (lat > isrprof.latmax) isrprof.latmax = lat;
+        if (bin >= PROF_BINS) bin = PROF_BINS - 1;
+        // Saturate instead of wrapping
+        if (isrprof.lathist[bin] != 0xFF) isrprof.lathist[bin]++;
+    }
+#endif
+
+    // Handle all events that are due, in order
+    while (CH_ANY()) {
+        unsigned char ch = CH_FIRST(), bit = chbit[ch];
+        unsigned short t = chtime[ch];
+
+        // Events within one tick are merged, and later ones get a compare
+        if ((short)(t - TAR) > 1) break;
+
+        ch_pop();
+
+#ifdef SERIAL_BAUD
+        if (ch == CH_SERIAL) {
+            if (ser_event(t)) ch_insert(ch);
+#ifdef TRACE
+            // Done sending, so wake main thread waiting to stop timer
+            else if (trflush) __bic_SR_register_on_exit(LPM4_bits);
+#endif
+            continue;
+        }
+#endif
+
+        if (chhold & bit) {
+            // End of gate pulse or hold, done by hardware for channel 0 if
+            // on time
+            chhold &= ~bit;
+            if (ch == 0) TACCTL0 = OUTMOD_0 | CCIE;
+            P2OUT &= ~(bit & P2_TRIACS);
+            // Set up next
+            chzc[ch] += hperiod;
+            chtime[ch] = chzc[ch] + triacdelay[ch];
+        } else {
+            // Fire, done by hardware for channel 0 if on time
+            if (ch == 0) TACCTL0 = OUTMOD_0 | OUT | CCIE;
+            P2OUT |= bit & P2_TRIACS;
+
+            // Gate stays on until the event ending its pulse or hold
+            chhold |= bit;
+#ifdef BURST_FIRE
+            // Held until case 6 of TACCR1_ISR ends the burst
+            continue;
+#endif
+            if (triacdelay[ch] > hold) {
+                // Gate pulse, ending at its own event. The gate may have
+                // only been turned on now, if ISR was late.
+                chtime[ch] = TAR + GATE_PULSE;
+            } else {
+                /* Attempting to turn on the TRIAC too early might fail,
+                 * because voltage is too low in that part of the AC cycle.
+                 * Keep the trigger signal active longer, so the TRIAC
+                 * turns on as soon as voltage is high enough to trigger
+                 * it. The hold is timed from the event, so ISR latency
+                 * doesn't change it. If this ISR is very late, hold from
+                 * now instead. */
+                if ((unsigned short)(TAR - t) < hold / 2) {
+                    chtime[ch] = t + hold;
+                } else {
+                    chtime[ch] = TAR + hold / 2;
+                }
+            }
+        }
 
-        delayoff = false;
-    } else {
-        /* Attempting to turn on the TRIAC too early might fail, because
-         * voltage is too low in that part of the AC cycle. Keep the
-         * trigger signal active longer, so the TRIAC turns on as soon as
-         * voltage is high enough to trigger it. */
-        TACCR0 = TAR + 1000;
-        delayoff = true;
+        if (triacdelay[ch] != 0 || (chhold & bit)) ch_insert(ch);
     }
+
+    ch_compare();
+#ifdef LPM3_IDLE
+    idle_start();
+#endif
+    PROF_EXIT(PROF_CCR0);
 } // TACCR0_ISR
 
 /*** Port 1 ISR, for user interface and fade triggering ***/
 #pragma vector=PORT1_VECTOR
 __interrupt void port1_ISR(void) {
-    // Disable and clear port interrupts, and let debouncing code handle this
-    P1IE = 0;
-    P1IFG = 0;
-    debctr = DEBOUNCE_LEN;
-
-    // Zero crossing detector is needed for debouncing and figuring out
-    // zero crossings before turning on the lamp
-    if ((TACCTL1 & CCIE) == 0) {
-        // Enable TA0.1 for monitoring zero crossing
-        // Capture on falling edge
-        zcmode = 0;
-        TACCTL1 = CM_2 | ZC_CCTL;
-        // Transition from LPM4 to LPM1
-        __bic_SR_register_on_exit(LPM4_bits & ~LPM1_bits);
+    unsigned char flags = P1IFG & P1IE;
+    PROF_ENTRY();
+
+#ifdef LPM3_IDLE
+    // Serial and TRACE_INPUT need TAR counting SMCLK
+    if (idlemode != IDLE_OFF) {
+        idle_cancel();
+        __bic_SR_register_on_exit(SCG1 | SCG0);
     }
+#endif
+
+#ifdef SERIAL_BAUD
+    if (flags & P1_SERIAL) ser_rxstart();
+    flags &= ~P1_SERIAL;
+#endif
+
+    if (flags != 0) {
+        // Disable and clear port interrupts, and let debouncing code
+        // handle this
+        P1IE &= P1_KEEP;
+        P1IFG &= P1_KEEP;
+        debctr = DEBOUNCE_LEN;
+        TRACE_INPUT(P1IN, TAR);
+
+        // Zero crossing detector is needed for debouncing and figuring out
+        // zero crossings before turning on the lamp
+        if ((TACCTL1 & CCIE) == 0) {
+            // Enable TA0.1 for monitoring zero crossing
+            // Capture on falling edge
+            zcmode = 0;
+            pllstart = true;
+            TACCTL1 = CM_2 | ZC_CCTL;
+            // Transition from LPM4 to LPM1
+            __bic_SR_register_on_exit(LPM4_bits & ~LPM1_bits);
+        }
+    }
+    PROF_EXIT(PROF_PORT1);
 } // port1_ISR
 
-/*** Dimming table, translating desired output power to trigger angle ***/
-/* The 16 bit dimming value uses the high order DIMTAB_BITS to select a
- * slot in this table, and the rest of the bits to linearly interpolate
- * within that slot. The last value would correspond to 0x10000, so it is
- * only approached using interpolation from 0xFFFF. */
-#define DIMTAB_BITS 5
-static const unsigned short dimtab[(1 << DIMTAB_BITS) + 1] = {
-    56707, /* 0.124568: 24.247302 */
-    55420, /* 0.151925: 27.782507 */
-    54194, /* 0.179282: 31.150470 */
-    53013, /* 0.206640: 34.392322 */
-    51868, /* 0.233997: 37.537146 */
-    50751, /* 0.261354: 40.606771 */
-    49654, /* 0.288711: 43.618355 */
-    48574, /* 0.316069: 46.585897 */
-    47505, /* 0.343426: 49.521292 */
-    46444, /* 0.370783: 52.434933 */
-    45388, /* 0.398140: 55.336210 */
-    44333, /* 0.425498: 58.233863 */
-    43276, /* 0.452855: 61.136266 */
-    42215, /* 0.480212: 64.051672 */
-    41146, /* 0.507569: 66.988419 */
-    40065, /* 0.534927: 69.955189 */
-    38971, /* 0.562284: 72.961213 */
-    37859, /* 0.589641: 76.016556 */
-    36724, /* 0.616998: 79.132443 */
-    35563, /* 0.644356: 82.321685 */
-    34370, /* 0.671713: 85.599198 */
-    33138, /* 0.699070: 88.982812 */
-    31859, /* 0.726427: 92.494287 */
-    30524, /* 0.753785: 96.160909 */
-    29120, /* 0.781142: 100.017907 */
-    27629, /* 0.808499: 104.112323 */
-    26028, /* 0.835856: 108.509643 */
-    24282, /* 0.863214: 113.305916 */
-    22336, /* 0.890571: 118.652257 */
-    20093, /* 0.917928: 124.811447 */
-    17360, /* 0.945285: 132.319079 */
-    13597, /* 0.972643: 142.654819 */
-    183, /* 1.000000: 179.496261 */
-};
+/*** ADC10 ISR, for end of pot sample block ***/
+#if POT_OVERSAMPLE
+#pragma vector = ADC10_VECTOR
+__interrupt void ADC10_ISR(void)
+{
+    PROF_ENTRY();
+
+    // Stop repeated conversions until TACCR1_ISR starts the next block
+    ADC10CTL0 &= ~(ENC | ADC10IE);
+    PROF_EXIT(PROF_ADC10);
+} // ADC10_ISR
+#endif
 
-int main( void )
+// Never returns, so it saves no registers for its caller
+__task int main( void )
 {
     // Stop watchdog timer to prevent time out reset
     WDTCTL = WDTPW + WDTHOLD;
 
     // Set up DCO
     DCOCTL = 0x00;          // Errata BCL12
-    BCSCTL1 = CALBC1_1MHZ;
-    // DCOx is 1 more than 1Mhz calibrated value
+    BCSCTL1 = CALBC1_SMCLK;
+    // DCOx is DCO_STEP more than calibrated value
     // MODx is 0 to prevent jitter
-    DCOCTL = (CALDCO_1MHZ & (DCO0|DCO1|DCO2)) + DCO0;
+    DCOCTL = (CALDCO_SMCLK & (DCO0|DCO1|DCO2)) + DCO0 * DCO_STEP;
+#ifdef LPM3_IDLE
+    // ACLK from VLO, for timing idle
+    BCSCTL3 = LFXT1S_2;
+#endif
+    // Flash timing generator from MCLK, within 257 to 476 kHz
+    FCTL2 = FWKEY | FSSEL_1 | (FLASH_DIV - 1);
+    pll_load();
+#ifdef ENERGY_METER
+    meter_load();
+#endif
 
     /*** Set up ports ***/
     P1OUT = P1_SW_ON | P1_SW_OFF | P1_TRIGGER;
     P1DIR = P1_TRIAC | P1_LED;
     // Trigger uses external pullup
-    P1REN = P1_SW_ON | P1_SW_OFF | P1_TRIGGER | P1_UNUSED;
+    P1REN = P1_SW_ON | P1_SW_OFF | P1_TRIGGER | P1_SERIAL;
+#ifdef SERIAL_BAUD
+    // Serial idles high, and start bit is a falling edge
+    P1OUT |= P1_SERIAL;
+    P1IES = P1_SERIAL;
+#endif
     P1SEL = P1_TRIAC | P1_ZEROCROSS;
     ADC10AE0 = P1_POT;
+#if POT_OVERSAMPLE
+    // DTC transfers one block of POT_SAMPLES for each ADC10SA write
+    ADC10DTC1 = POT_SAMPLES;
+#endif
 
     // Port 2 as GPIO because XIN and XOUT are unused
+    // P2.6 and P2.7 drive TRIAC channels 1 and 2 if used
     P2SEL = 0;
     P2OUT = 0;
-    P2REN = 0xFF;
+    P2DIR = P2_TRIACS;
+    P2REN = 0xFF & ~P2_TRIACS;
 
     // RST/NMI needs 47 kohm pullup with 10 nF (or for 2.2 nF SBW) pulldown
     // TEST can remain open
 
     /*** Set up timer A ***/
-    // TA0: SMCLK/1, continuous
-    TACTL = TASSEL_2 | MC_2 | TACLR;
+    // TA0: SMCLK/TIMER_DIV, continuous
+    TACTL = TASSEL_2 | TIMER_ID | MC_2 | TACLR;
     // Enable zero crossing detector to determine initial state
     TACCTL1 = CM_2 | ZC_CCTL;
 
@@ -433,50 +2609,112 @@ int main( void )
 
     /*** Main loop ***/
     while (1) {
-        static unsigned short curdimpower = 0;
+        unsigned char ch;
 
+        // Checked with interrupts disabled, so a wakeup can't be missed
+        __disable_interrupt();
         if (state > STATE_TRIGWAIT || curdimpower != 0 || debctr != 0) {
             // Lit or figuring out next state
-            // Wait here until new dimming value is available
-            __bis_SR_register(LPM0_bits);
+            // Wait here until state changes. TACCR1_ISR sets triacdelay
+            // and steps fades.
+            __bis_SR_register(LPM0_bits | GIE);
         } else {
             // Unlit, waiting for trigger or switch
+            __enable_interrupt();
 
             // LED off here, ensuring it can't remain off while TRIAC is on
             P1OUT &= ~P1_LED;
 
+#if defined(TRACE) && defined(SERIAL_BAUD)
+            // Send rest of trace before timer stops. With captures and
+            // TRIACs off first, only port 1 ISR can add records.
+            __disable_interrupt();
+            TACCTL1 = 0;
+            for (ch = 0; ch < CHANNELS; ch++) ch_remove(ch);
+            chhold = 0;
+            P2OUT &= ~P2_TRIACS;
+            ch_arm();
+            if (plllock < PLL_LOCKED) {
+                // Bit length unknown
+                sertxtail = sertxhead;
+                trlost = true;
+            }
+            while (sermode != SER_IDLE || sertxtail != sertxhead) {
+                serburst = TRACE_SIZE;
+                ser_send();
+                trflush = true;
+                __bis_SR_register(LPM0_bits | GIE);
+                __disable_interrupt();
+            }
+            trflush = false;
+            __enable_interrupt();
+            // Port 1 ISR restarted zero crossing detection while sending
+            if (TACCTL1 & CCIE) continue;
+#endif
+
             // Disable timer interrupts.
             // Only port interrupts can exit this state.
+            // If port 1 ISR ran since the check, debouncing needs them.
+            __disable_interrupt();
+            if (debctr != 0) {
+                __enable_interrupt();
+                continue;
+            }
             TACCTL0 = OUTMOD_0; // Also turn off TRIAC driver
             TACCTL1 = 0;
+            P2OUT &= ~P2_TRIACS;
+            __enable_interrupt();
 
-            // TRIAC stays off until new delay is calculated
-            triacdelay = 0;
+            // TRIACs stay off until new delay is calculated
+            for (ch = 0; ch < CHANNELS; ch++) triacdelay[ch] = 0;
+#ifdef BURST_FIRE
+            for (ch = 0; ch < CHANNELS; ch++) burstpower[ch] = 0;
+#endif
+#ifdef SERIAL_BAUD
+            // Serial stops with the timer, dropping unsent telemetry
+            P1IE &= ~P1_SERIAL;
+            P1DIR &= ~P1_SERIAL;
+            P1OUT |= P1_SERIAL;
+            sermode = SER_IDLE;
+#ifdef TRACE
+            sertxtail = sertxhead;
+#else
+            serbyte = SER_FRAMELEN;
+#endif
+#endif
+#if CH_SLOTS > 1
+            chnum = 0;
+#endif
+            chqueued = 0;
+            chhold = 0;
+            delayhperiod = 0;
+#ifdef LPM3_IDLE
+            idlemode = IDLE_OFF;
+#endif
+
+            /* Start from this period next time, and after reset. With
+             * interrupts disabled, which flash writes need, and so zero
+             * crossing interrupts after port 1 ISR restarts detection don't
+             * nest on top of the saves. */
+            __disable_interrupt();
+            if (plllock >= PLL_LOCKED) pll_save((pllperiod + 0x8000) >> 16);
+#ifdef ENERGY_METER
+            meter_save();
+#endif
+            __enable_interrupt();
 
-            // Wait here until lamp needs to be lit
-            __bis_SR_register(LPM4_bits);
+            // Wait here until lamp needs to be lit. If port 1 ISR already
+            // restarted zero crossing detection, LPM4 would stop the timer
+            // debouncing needs. GIE is set along with LPM4, so an
+            // interrupt after the check still wakes this.
+            TRACE_STOP();
+            __disable_interrupt();
+            if (debctr == 0) __bis_SR_register(LPM4_bits | GIE);
+            __enable_interrupt();
 
             // Zero crossing detector is turned on by port 1 ISR
 
             // TRIAC driver is turned on by zero crossing detector ISR
         }
-
-        // Don't inadvertently turn on TRIAC
-        if (state > STATE_TRIGWAIT || curdimpower != 0) {
-            /*** Convert linearized dimming power to TRIAC delay */
-            // Avoid glitches if dimpower is changed by interrupt
-            __disable_interrupt();
-            curdimpower = dimpower;
-            updatedim = false;
-            __enable_interrupt();
-
-            // Find table index
-            unsigned short dimidx = curdimpower >> (16 - DIMTAB_BITS);
-            // Linearly interpolate and scale based on current period
-            triacdelay = mult(dimtab[dimidx] -
-                              mult(dimtab[dimidx]-dimtab[dimidx+1],
-                                   curdimpower << DIMTAB_BITS),
-                              hperiod);
-        }
     } // while(1)
 } // main()
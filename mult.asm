@@ -20,6 +20,20 @@
 
         NAME mult
 
+; Implementation, selected at build time with MULT_IMPL defined for the
+; assembler. All give the same result, floor(a * ((b + 1) >> 1) / 8000h).
+; Cycles are from call to return, with the average over all operands, as
+; reported by Tools/multcycles.
+; 0  Bit-serial loop, 32 bytes, 130 to 178 cycles, 154 average
+; 1  Bit-serial loop per byte, skipping bytes of a that are zero, and
+;    stopping if b is zero, 78 bytes, 14 to 197 cycles, 172.5 average.
+;    Only faster than 0 when a is usually below 100h.
+; 2  Unrolled, 136 bytes, 75 to 91 cycles, 83 average
+; 3  Hardware multiplier, 36 bytes, 34 cycles, on parts that have one
+#ifndef MULT_IMPL
+#define MULT_IMPL 0
+#endif
+
         EXTERN rgbout
         EXTERN rgbval
 
@@ -27,6 +41,7 @@
 ;        PUBLIC square
         RSEG CODE
 
+#if MULT_IMPL == 0
 ; unsigned short square(unsigned short a)
 ; r12 = a, r12 = result
 ; clobbers: r14, r13
@@ -61,4 +76,117 @@ multzb;
 
 multend;
         ret
+
+#elif MULT_IMPL == 1
+; Same loop for each byte of a. Result stays zero through a zero low byte,
+; and a zero high byte only halves it 8 times.
+; r12 = a, r13 = b, r12 = result
+; clobbers: r14, r15, r13 = (r13 & 1) + (r13 >> 1)
+mult;
+        mov.w   r12,r14         ; [1] Separate result and a
+        xor.w   r12,r12         ; [1] Zero result, clear carry
+        rrc.w   r13             ; [1] b = b / 2
+        addc.w  #0, r13         ; [1] Round up b
+        jz      multend         ; [2] b is 0, so result is 0
+
+        tst.b   r14             ; [1]
+        jz      multhi          ; [2] Low byte of a is 0
+        mov.b   r14,r15         ; [1] Low byte of a
+        add.w   #100h,r15       ; [2] Bit signals end of byte, clear carry
+multlo;
+        rrc.w   r15             ; [1]
+        jnc     multlz          ; [2]
+        jz      multhi          ; [2] Bit added above just shifted out
+        clrc                    ; [1]
+        rrc.w   r12             ; [1]
+        add.w   r13,r12         ; [1] 1 bit in a, so add b
+        jmp     multlo          ; [2]
+multlz;
+        rrc.w   r12             ; [1] Carry was already clear
+        clrc                    ; [1]
+        jmp     multlo          ; [2]
+
+multhi;
+        swpb    r14             ; [1]
+        tst.b   r14             ; [1]
+        jz      multsh          ; [2] High byte of a is 0
+        mov.b   r14,r14         ; [1] High byte of a
+        add.w   #100h,r14       ; [2] Bit signals end of byte, clear carry
+multhl;
+        rrc.w   r14             ; [1]
+        jnc     multhz          ; [2]
+        jz      multend         ; [2] Bit added above just shifted out
+        clrc                    ; [1]
+        rrc.w   r12             ; [1]
+        add.w   r13,r12         ; [1] 1 bit in a, so add b
+        jmp     multhl          ; [2]
+multhz;
+        rrc.w   r12             ; [1] Carry was already clear
+        clrc                    ; [1]
+        jmp     multhl          ; [2]
+
+multsh;
+        swpb    r12             ; [1] Result / 256
+        mov.b   r12,r12         ; [1]
+multend;
+        ret                     ; [3]
+
+#elif MULT_IMPL == 2
+; Carry is clear at the start of each step, because the sum never exceeds
+; 0FFFFh. Bits shifted into the top of a never reach bit 0.
+; r12 = a, r13 = b, r12 = result
+; clobbers: r14, r13 = (r13 & 1) + (r13 >> 1)
+multbit MACRO
+        LOCAL   skip
+        rrc.w   r12             ; [1]
+        rrc.w   r14             ; [1]
+        jnc     skip            ; [2]
+        add.w   r13,r12         ; [1] 1 bit in a, so add b
+skip
+        ENDM
+
+mult;
+        mov.w   r12,r14         ; [1] Separate result and a
+        xor.w   r12,r12         ; [1] Zero result, clear carry
+        rrc.w   r13             ; [1] b = b / 2
+        addc.w  #0, r13         ; [1] Round up b, clear carry
+
+        rrc.w   r14             ; [1] Bit 0, with result still 0
+        jnc     multb1          ; [2]
+        add.w   r13,r12         ; [1]
+multb1;
+        REPT    15
+        multbit
+        ENDR
+        ret                     ; [3]
+
+#elif MULT_IMPL == 3
+; Full product from the hardware multiplier, shifted right by 15. The
+; multiplier is shared with interrupts, which mult() can be called from.
+; r12 = a, r13 = b, r12 = result
+; clobbers: r14, r13 = (r13 & 1) + (r13 >> 1)
+MPY     EQU     0130h
+OP2     EQU     0138h
+RESLO   EQU     013Ah
+RESHI   EQU     013Ch
+
+mult;
+        clrc                    ; [1]
+        rrc.w   r13             ; [1] b = b / 2
+        addc.w  #0, r13         ; [1] Round up b
+        push.w  SR              ; [3]
+        dint                    ; [1]
+        nop                     ; [1] Interrupts are disabled after this
+        mov.w   r12,&MPY        ; [4]
+        mov.w   r13,&OP2        ; [4] Starts multiplication
+        mov.w   &RESLO,r14      ; [3]
+        mov.w   &RESHI,r12      ; [3]
+        pop.w   SR              ; [2]
+        rla.w   r14             ; [1] Top bit of low word
+        rlc.w   r12             ; [1] into result
+        ret                     ; [3]
+
+#else
+#error "Unknown MULT_IMPL"
+#endif
         END
@@ -0,0 +1,90 @@
+/* Composite pot table, translating averaged pot value to trigger angle.
+ * Generated by: Tools/dimtab -a 1500 -o pottab.h
+ * It folds in POTTAB_OFFSET added to the pot value and saturation at
+ * 0xFFFF, then the dimming curve, with regions and slots like dimtab.h.
+ */
+
+/* 8 regions, 66 bytes, max power error 0.004045
+ * 0x0000-0x1FFF:   1 entries, max error 0.000721
+ * 0x2000-0x3FFF:   1 entries, max error 0.000409
+ * 0x4000-0x5FFF:   1 entries, max error 0.000071
+ * 0x6000-0x7FFF:   1 entries, max error 0.000742
+ * 0x8000-0x9FFF:   1 entries, max error 0.001867
+ * 0xA000-0xBFFF:   1 entries, max error 0.004045
+ * 0xC000-0xDFFF:   2 entries, max error 0.003199
+ * 0xE000-0xFFFF:  16 entries, max error 0.002704
+ */
+
+#define POTTAB_REGION_BITS 3
+// Square root of power at dimming value 0
+#define POTTAB_P0 0.124568
+// Added to pot value, saturating, giving dimming value
+#define POTTAB_OFFSET 1500
+// Largest half-period for which potdelay() was checked
+#define POTTAB_MAX_HPERIOD 65535
+
+// Right shift of pot value bits within region, giving slot
+static const unsigned char pottab_shift[8] = { 13, 13, 13, 13, 13, 13, 12, 9 };
+// Index of first slot of region
+static const unsigned char pottab_first[8] = { 0, 1, 2, 3, 4, 5, 6, 8 };
+
+// Trigger delay at start of slot, with 0xFFFF == 1.0
+static const unsigned short pottab[25] = {
+    55758, /* 0.144605: 26.855039 */
+    51047, /* 0.254034: 39.791750 */
+    46728, /* 0.363463: 51.656902 */
+    42500, /* 0.472892: 63.269845 */
+    38158, /* 0.582321: 75.193579 */
+    33472, /* 0.691750: 88.065897 */
+    28038, /* 0.801179: 102.990209 */
+    24766, /* 0.855894: 111.976263 */
+    20730, /* 0.910608: 123.061258 */
+    20136, /* 0.917447: 124.693793 */
+    19513, /* 0.924287: 126.406441 */
+    18855, /* 0.931126: 128.211804 */
+    18158, /* 0.937965: 130.125941 */
+    17414, /* 0.944805: 132.169830 */
+    16613, /* 0.951644: 134.371706 */
+    15739, /* 0.958483: 136.771048 */
+    14772, /* 0.965323: 139.425886 */
+    13680, /* 0.972162: 142.427299 */
+    12403, /* 0.979001: 145.932851 */
+    10828, /* 0.985840: 150.259759 */
+    8644, /* 0.992680: 156.259044 */
+    3458, /* 0.999519: 170.501486 */
+    1046, /* 0.999987: 177.127665 */
+    1046, /* 0.999987: 177.127665 */
+    1046, /* 0.999987: 177.127665 */
+};
+
+/* Slot potdelay() last scaled, with its base and slope scaled by the h it
+ * was scaled for. Set pottab_cslot to POTTAB_NOSLOT when h changes, which
+ * saves keeping h.
+ */
+#define POTTAB_NOSLOT 0xFF
+static unsigned char pottab_cslot = POTTAB_NOSLOT;
+static unsigned short pottab_hbase, pottab_hslope;
+
+/* Convert pot value to trigger delay in timer cycles, for half-period
+ * h. The slot endpoints are scaled by h before interpolating, which keeps
+ * the result monotonic across slots. While the slot is unchanged, that
+ * is kept, and conversion takes one mult(). Tools/dimtab checked that it
+ * is within 1 of mult(interpolated delay, h) for h up to
+ * POTTAB_MAX_HPERIOD.
+ */
+static unsigned short potdelay(unsigned short pot, unsigned short h)
+{
+    unsigned char region = pot >> (16 - POTTAB_REGION_BITS);
+    unsigned char shift = pottab_shift[region];
+    unsigned char slot = pottab_first[region] +
+        ((pot & (0xFFFF >> POTTAB_REGION_BITS)) >> shift);
+
+    if (slot != pottab_cslot) {
+        pottab_hbase = mult(pottab[slot], h);
+        pottab_hslope = pottab_hbase - mult(pottab[slot + 1], h);
+        pottab_cslot = slot;
+    }
+
+    // Linearly interpolate between scaled endpoints using remaining bits
+    return pottab_hbase - mult(pottab_hslope, pot << (16 - shift));
+}